@@ -26,31 +26,276 @@
 #include <unistd.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <stddef.h>
+#include <pwd.h>
+#include <grp.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <ctype.h>
+#include <sys/prctl.h>
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Main variables
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-static unsigned short int ccs_retries = 0;
-static FILE *ccs_domain_fp = NULL;
 #define CCS_MAX_READLINE_HISTORY 20
+#define CCS_RESCAN_INTERVAL 100
 static const char **ccs_readline_history = NULL;
-static struct timeval start_time_allowance;
-static bool firstrun = true;
-static bool allownLearn = false;
 static char ccs_buffer[32768] = "";
 static char ccs_buffer_cleaned[32768] = "";
-static char ccs_buffer_previous1[32768] = "";
-static char ccs_buffer_previous2[32768] = "";
-static char ccs_buffer_previous3[32768] = "";
 static char message_question[32768] = "";
-static char extracted_domain[32768] = "";
-static int ccs_buffer_previous_answer1 = 2;
-static int ccs_buffer_previous_answer2 = 2;
-static int ccs_buffer_previous_answer3 = 2;
 static int how_many_auto_query_repeat = 0;
 static int ccs_readline_history_count = 0;
 static int ccs_domain_policy_fd = EOF;
+static struct ccs_reader ccs_query_reader;   //Network mode, records from the agent
+
+//Part of a query record, not NUL-terminated
+struct ccs_slice {
+	const char *ptr;
+	int len;
+};
+
+//One /proc/ccs/query record, fields point into the record it was parsed from
+struct ccs_query_info {
+	unsigned int serial;
+	unsigned short int retry;
+	const char *text;                     //Record without the "Q%u-%hu" line
+	struct ccs_slice header;              //"#timestamp# profile=..." line
+	struct ccs_slice timestamp;
+	struct ccs_slice mode;
+	struct ccs_slice task;                //Inside "task={ ... }"
+	unsigned int profile;
+	unsigned int global_pid;
+	unsigned int pid;
+	unsigned int ppid;
+	const struct ccs_path_info *domain;   //ccs_savename()'d, domain queries only
+	const char *acl;                      //Last line, domain queries only
+	_Bool is_domain_query;
+	_Bool provisional;                    //Kernel already answered, the prompt only decides for next time
+	unsigned long long received_us;       //ccs_usec_now() when reading started
+};
+
+//Queries waiting for an answer from a prompt (one entry per kernel serial)
+struct ccs_pending_query {
+	struct ccs_query_info query;          //Owns query.text
+	unsigned int prompt_id;   //Helper dialog answering this query, 0 if waiting on another query's prompt
+	unsigned long long prompted_us;
+};
+static struct ccs_pending_query *ccs_pending_list = NULL;
+static int ccs_pending_list_len = 0;
+//Recently answered serials, a query read just before its answer was written can still show up once
+#define CCS_ANSWERED_HISTORY 64
+static unsigned int ccs_answered_serials[CCS_ANSWERED_HISTORY];
+static int ccs_answered_pos = 0;
+//Provisional answers (--provisional=SEC) for queries whose prompt is still open at the deadline
+static int ccs_provisional_deadline = 0;      //Seconds, 0 waits for the prompt
+static int ccs_provisional_retries = 0;       //Retry instead of deny while the query was retried fewer times
+static int ccs_provisional_fd = EOF;
+
+//Decision cache: answers given by the user, keyed on (interned domain, ACL line)
+struct ccs_decision {
+	struct ccs_decision *hash_next;
+	struct ccs_decision *lru_prev;        //Towards the most recently used entry
+	struct ccs_decision *lru_next;        //Towards the least recently used entry
+	const struct ccs_path_info *domain;   //ccs_savename()'d domainname
+	struct ccs_path_info acl;             //Owned copy of the ACL line
+	time_t expires;
+	int answer;                           //'Y' or 'N'
+};
+#define CCS_DECISION_HASH 1024
+static struct ccs_decision *ccs_decision_hash[CCS_DECISION_HASH];
+static struct ccs_decision *ccs_decision_lru_head = NULL;
+static struct ccs_decision *ccs_decision_lru_tail = NULL;
+static int ccs_decision_count = 0;
+static int ccs_decision_capacity = 1024;
+static int ccs_decision_allow_ttl = 3600;
+static int ccs_decision_deny_ttl = 600;
+
+//Auto-answer rules loaded from --rules=FILE, first match wins
+struct ccs_rule {
+	const struct ccs_path_info *domain;   //Domainname pattern
+	const struct ccs_path_info *acl;      //ACL line pattern
+	int answer;                           //'Y' or 'N'
+};
+static struct ccs_rule *ccs_rule_list = NULL;
+static int ccs_rule_list_len = 0;
+static const char *ccs_rules_file = NULL;
+
+//Latency histograms (microseconds) per stage of the query pipeline and per verdict source
+enum ccs_stage {
+	CCS_STAGE_READ,       //Reading the query record
+	CCS_STAGE_PARSE,
+	CCS_STAGE_LOOKUP,     //Rules and decision cache
+	CCS_STAGE_PROMPT,     //Handing the dialog to the prompt helper
+	CCS_STAGE_WAIT,       //Dialog open
+	CCS_STAGE_POLICY,     //Writing use_profile or learned lines
+	CCS_STAGE_ANSWER,     //Writing A%u=%u
+	CCS_MAX_STAGE
+};
+#define CCS_HIST_SUB_BITS 4                   //16 buckets per power of two, about 6% resolution
+#define CCS_HIST_BUCKETS ((32 - CCS_HIST_SUB_BITS + 1) << CCS_HIST_SUB_BITS)
+struct ccs_histogram {
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned int min;
+	unsigned int max;
+	unsigned long long buckets[CCS_HIST_BUCKETS];
+};
+static struct ccs_histogram ccs_stage_hist[CCS_MAX_STAGE];
+static struct ccs_histogram ccs_source_hist[CCS_MAX_JOURNAL_SOURCE];  //From reading the query to the answer
+static const char *ccs_stats_file = NULL;
+
+//Decision journal (--journal=FILE), records are queued in a ring the writer thread drains
+struct ccs_journal_id {
+	struct ccs_journal_id *next;
+	const struct ccs_path_info *name;     //ccs_savename()'d domainname or ACL line
+	u32 id;
+};
+#define CCS_JOURNAL_ID_HASH 4096
+#define CCS_JOURNAL_RING (1 << 20)            //Bytes, records are dropped when full
+#define CCS_JOURNAL_INTERVAL 200              //msec between writer passes
+static struct ccs_journal_id *ccs_journal_ids[CCS_JOURNAL_ID_HASH];
+static u32 ccs_journal_next_id = 1;
+static const char *ccs_journal_file = NULL;
+static int ccs_journal_fd = EOF;
+static char *ccs_journal_ring = NULL;
+static unsigned long ccs_journal_head = 0;    //Moved by the event loop only
+static unsigned long ccs_journal_tail = 0;    //Moved by the writer thread only
+static unsigned long ccs_journal_dropped = 0;
+static unsigned long ccs_journal_lost = 0;    //Decisions a failed write lost, writer thread only
+static _Bool ccs_journal_stop = false;
+static pthread_t ccs_journal_thread;
+
+//Prompt helper: child started once at startup that opens the zenity dialogs for us
+enum ccs_prompt_kind {
+	CCS_PROMPT_QUERY,     //Allow & Learn / Allow All & Save / Allow / Deny / Deny All
+	CCS_PROMPT_QUESTION,  //Yes / No
+	CCS_PROMPT_WARNING,   //Ok, nobody waits for the answer
+	CCS_PROMPT_NOTIFY,    //notify-send in the desktop session, no answer either
+};
+struct ccs_prompt_request {
+	unsigned int id;
+	int kind;
+	int timeout;
+	char text[32768];     //Sent up to and including the NUL
+};
+struct ccs_prompt_reply {
+	unsigned int id;
+	int result;           //Same codes the old shell prompts exited with (36864 = Allow...)
+};
+static int ccs_prompt_fd = EOF;
+static unsigned int ccs_prompt_id = 0;
+static unsigned int ccs_quit_prompt_id = 0;
+
+//Learned ACL lines, queued and written to domain_policy in batches grouped by domain
+struct ccs_learned_line {
+	const struct ccs_path_info *domain;
+	const struct ccs_path_info *line;
+};
+#define CCS_LEARN_BATCH 64                //Lines, or
+#define CCS_LEARN_FLUSH_INTERVAL 1000     //msec after the first queued line
+static struct ccs_learned_line **ccs_learn_queue = NULL;
+static int ccs_learn_queue_len = 0;
+
+//Learn sessions started by Allow & Learn, each domain learns until its time or lines run out
+struct ccs_learn_session {
+	const struct ccs_path_info *domain;   //ccs_savename()'d
+	time_t expires;                       //ccs_monotonic_now()
+	int budget;                           //Lines left
+};
+static struct ccs_learn_session *ccs_learn_sessions = NULL;
+static int ccs_learn_sessions_len = 0;
+static int ccs_learn_session_time = 120;      //Seconds, --learn-time=
+static int ccs_learn_session_lines = 256;     //--learn-lines=
+
+//Learned paths per domain, operation and rest of the line, see ccs_generalize()
+struct ccs_learn_group {
+	const struct ccs_path_info *domain;
+	const struct ccs_path_info *operation;    //"file read"
+	const struct ccs_path_info *tail;         //After the path, "" if nothing
+	const struct ccs_path_info **paths;       //Learned and not covered by a pattern yet
+	int paths_len;
+	const struct ccs_path_info **patterns;    //Learned instead of the paths they cover
+	int patterns_len;
+};
+#define CCS_GENERALIZE_WINDOW 32              //Recent paths a new one is paired with
+static struct ccs_learn_group *ccs_learn_groups = NULL;
+static int ccs_learn_groups_len = 0;
+static int ccs_generalize_min = 0;            //--generalize=N, paths a pattern must cover, 0 = off
+
+//What the kernel's domain_policy holds, see ccs_mirror_load()
+static struct ccs_domain_policy ccs_domain_mirror = { NULL, 0, NULL };
+
+//Background saver, save_policy() only marks the policy dirty
+static pthread_t ccs_saver_thread;
+static pthread_mutex_t ccs_saver_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ccs_saver_wake;
+static struct timespec ccs_saver_first_mark;
+static _Bool ccs_saver_dirty = false;
+static _Bool ccs_saver_stop = false;
+static int ccs_saver_delay = 2000;         //msec, --save-delay=
+static int ccs_saver_pipe[2] = { EOF, EOF };
+
+//Headless mode (--daemon, or no terminal): no curses, ccs_printw() goes to a log
+static _Bool ccs_headless = false;
+static int ccs_log_fd = 2;
+static char *ccs_log_buf = NULL;
+static int ccs_log_len = 0;
+static int ccs_log_size = 0;
+static _Bool ccs_log_line_start = true;
+#define CCS_LOG_FLUSH_SIZE 65536
+
+//Interactive mode: ccs_printw() appends to a scrollback ring, the screen is
+//repainted from it at most once per CCS_FRAME_INTERVAL
+struct ccs_screen_line {
+	char *text;
+	int len;
+};
+#define CCS_SCROLLBACK_LINES 4096
+#define CCS_FRAME_INTERVAL 40                 //msec
+static struct ccs_screen_line ccs_scrollback[CCS_SCROLLBACK_LINES];
+static int ccs_scrollback_head = 0;           //Oldest line
+static int ccs_scrollback_len = 0;
+static _Bool ccs_scrollback_open = false;     //Newest line not ended by '\n' yet
+static _Bool ccs_frame_pending = false;
+static int ccs_frame_fd = EOF;
+
+//Event loop: query fd, keyboard, prompt helper, keepalive timer, rescan timer, SIGCHLD and SIGTERM
+static int ccs_epoll_fd = EOF;
+static int ccs_keepalive_fd = EOF;
+static int ccs_rescan_fd = EOF;
+static int ccs_signal_fd = EOF;
+static int ccs_learn_fd = EOF;
+static _Bool ccs_query_requested = false;
+static _Bool ccs_query_watched = false;
+static _Bool ccs_scan_started = false;        //A serial was read since the last pause
+static unsigned int ccs_scan_first;           //First serial read in this pass
+
+//Capture (--capture=FILE) and replay (--replay=FILE) of query records, see ccs_replay_tick()
+struct ccs_replay_prompt {
+	unsigned int id;
+	unsigned long long due;               //ccs_usec_now() when the scripted answer is given
+};
+#define CCS_CAPTURE_BUFFER (1 << 20)
+#define CCS_REPLAY_BATCH 64                   //Records fed between two event loop passes
+static FILE *ccs_capture_fp = NULL;
+static unsigned long long ccs_capture_start = 0;
+static FILE *ccs_replay_fp = NULL;
+static double ccs_replay_speed = 1;           //--replay-speed=, 0 feeds records as fast as they are handled
+static int ccs_replay_result = 36864;         //--replay-answer=, what every prompt answers
+static int ccs_replay_think = 0;              //--replay-think=MSEC before prompts answer
+static int ccs_replay_fd = EOF;
+static struct ccs_replay_prompt *ccs_replay_prompts = NULL;
+static int ccs_replay_prompts_len = 0;
+static _Bool ccs_replay_ready = false;        //Header of the next record read
+static unsigned long long ccs_replay_offset = 0;
+static int ccs_replay_len = 0;
+static unsigned long long ccs_replay_base = 0;    //When offset 0 is due
+static unsigned long long ccs_replay_started = 0;
+static int ccs_replay_count = 0;
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Prototypes
@@ -59,30 +304,320 @@ static int ccs_domain_policy_fd = EOF;
 static void ccs_printw(const char *fmt, ...)
 	__attribute__ ((format(printf, 1, 2)));
 
-static _Bool ccs_handle_query(unsigned int serial);
+static _Bool ccs_handle_query(const struct ccs_query_info *q);
+static unsigned int ccs_prompt(int kind, const char *text, const char *timeout);
+static void ccs_watch_fd(int fd, _Bool watch);
+static void ccs_arm_timer(int fd, int msec, _Bool periodic);
+static void ccs_update_keepalive(void);
+static void ccs_arm_provisional(void);
+static _Bool ccs_generalized_covers(const struct ccs_path_info *domain,
+				    const char *line);
+static void ccs_generalize(const struct ccs_path_info *domain,
+			   const struct ccs_path_info *acl);
+static void ccs_decision_forget_domain(const struct ccs_path_info *domain);
+static _Bool ccs_finish_query(const struct ccs_query_info *q, int xresult,
+			      _Bool from_prompt, int *answer);
+static unsigned int ccs_replay_prompt(int kind);
+static _Bool ccs_process_query(unsigned long long start);
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Utility functions - Printf
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+//Headless mode: log records are written to ccs_log_fd in batches
+static void ccs_log_flush(void)
+{
+	int done = 0;
+	while (done < ccs_log_len) {
+		const int len = write(ccs_log_fd, ccs_log_buf + done,
+				      ccs_log_len - done);
+		if (len <= 0 && errno != EINTR)
+			break;
+		if (len > 0)
+			done += len;
+	}
+	ccs_log_len = 0;
+}
+
+//Append @len bytes of @text to the log, every line starts with the time
+static void ccs_log_append(const char *text, int len)
+{
+	static time_t stamped = 0;
+	static char stamp[32];
+	while (len > 0) {
+		const char *cp = memchr(text, '\n', len);
+		const int line_len = cp ? cp - text + 1 : len;
+		if (ccs_log_len + line_len + sizeof(stamp) > ccs_log_size) {
+			ccs_log_size = ccs_log_len + line_len + sizeof(stamp) +
+				CCS_LOG_FLUSH_SIZE;
+			ccs_log_buf = ccs_realloc(ccs_log_buf, ccs_log_size);
+		}
+		if (ccs_log_line_start) {
+			const time_t now = time(NULL);
+			if (now != stamped) {
+				struct tm tm;
+				stamped = now;
+				localtime_r(&now, &tm);
+				strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S ", &tm);
+			}
+			memcpy(ccs_log_buf + ccs_log_len, stamp, strlen(stamp));
+			ccs_log_len += strlen(stamp);
+		}
+		memcpy(ccs_log_buf + ccs_log_len, text, line_len);
+		ccs_log_len += line_len;
+		ccs_log_line_start = cp != NULL;
+		text += line_len;
+		len -= line_len;
+	}
+	if (ccs_log_len >= CCS_LOG_FLUSH_SIZE)
+		ccs_log_flush();
+}
+
+static void ccs_scrollback_append(const char *text, int len)
+{
+	while (len > 0) {
+		const char *cp = memchr(text, '\n', len);
+		const int chunk = cp ? cp - text : len;
+		struct ccs_screen_line *line;
+		int i;
+		if (!ccs_scrollback_open) {
+			if (ccs_scrollback_len == CCS_SCROLLBACK_LINES) {
+				free(ccs_scrollback[ccs_scrollback_head].text);
+				ccs_scrollback_head = (ccs_scrollback_head + 1) %
+					CCS_SCROLLBACK_LINES;
+				ccs_scrollback_len--;
+			}
+			line = &ccs_scrollback[(ccs_scrollback_head + ccs_scrollback_len++) %
+					       CCS_SCROLLBACK_LINES];
+			line->text = NULL;
+			line->len = 0;
+			ccs_scrollback_open = true;
+		}
+		line = &ccs_scrollback[(ccs_scrollback_head + ccs_scrollback_len - 1) %
+				       CCS_SCROLLBACK_LINES];
+		line->text = ccs_realloc(line->text, line->len + chunk + 1);
+		for (i = 0; i < chunk; i++) {
+			const unsigned char c = text[i];
+			line->text[line->len++] = (c < ' ' || c == 127) ? ' ' : c;
+		}
+		line->text[line->len] = '\0';
+		if (cp) {
+			ccs_scrollback_open = false;
+			text += chunk + 1;
+			len -= chunk + 1;
+		} else {
+			len = 0;
+		}
+	}
+}
+
+//Line @index of the scrollback, one past the newest is the empty line the cursor waits on
+static const struct ccs_screen_line *ccs_scrollback_line(int index)
+{
+	static const struct ccs_screen_line empty = { "", 0 };
+	if (index >= ccs_scrollback_len)
+		return &empty;
+	return &ccs_scrollback[(ccs_scrollback_head + index) % CCS_SCROLLBACK_LINES];
+}
+
+//Draw the tail of the scrollback, curses only sends the cells that changed
+static void ccs_repaint(void)
+{
+	const int cols = COLS > 0 ? COLS : 80;
+	const int count = ccs_scrollback_len + !ccs_scrollback_open;
+	int rows = 0;
+	int skip;
+	int first;
+	int y = 0;
+	int x = 0;
+	int i;
+	ccs_frame_pending = false;
+	for (first = count - 1; first > 0; first--) {
+		const int len = ccs_scrollback_line(first)->len;
+		rows += len ? (len + cols - 1) / cols : 1;
+		if (rows >= LINES)
+			break;
+	}
+	if (first == 0) {
+		const int len = ccs_scrollback_line(0)->len;
+		rows += len ? (len + cols - 1) / cols : 1;
+	}
+	skip = rows > LINES ? rows - LINES : 0;
+	scrollok(stdscr, FALSE);
+	erase();
+	for (i = first; i < count; i++) {
+		const struct ccs_screen_line *line = ccs_scrollback_line(i);
+		int offset = 0;
+		do {
+			const int len = line->len - offset < cols ? line->len - offset : cols;
+			if (skip) {
+				skip--;
+			} else {
+				if (len)
+					mvaddnstr(y, 0, line->text + offset, len);
+				x = len;
+				y++;
+			}
+			offset += cols;
+		} while (offset < line->len);
+	}
+	move(y ? y - 1 : 0, x < cols ? x : cols - 1);
+	refresh();
+}
+
 static void ccs_printw(const char *fmt, ...)
 {
+	static char *buffer = NULL;
+	static int buffer_size = 0;
 	va_list args;
-	int i;
 	int len;
-	char *buffer;
-	va_start(args, fmt);
-	len = vsnprintf((char *) &i, sizeof(i) - 1, fmt, args) + 16;
-	va_end(args);
-	buffer = ccs_malloc(len);
 	va_start(args, fmt);
-	len = vsnprintf(buffer, len, fmt, args);
+	len = vsnprintf(buffer, buffer_size, fmt, args);
 	va_end(args);
-	for (i = 0; i < len; i++) {
-		addch(buffer[i]);
-		refresh();
+	if (len >= buffer_size) {
+		buffer_size = len + 256;
+		buffer = ccs_realloc(buffer, buffer_size);
+		va_start(args, fmt);
+		len = vsnprintf(buffer, buffer_size, fmt, args);
+		va_end(args);
+	}
+	if (len <= 0)
+		return;
+	if (ccs_headless) {
+		ccs_log_append(buffer, len);
+		return;
+	}
+	ccs_scrollback_append(buffer, len);
+	if (!ccs_frame_pending) {
+		ccs_frame_pending = true;
+		ccs_arm_timer(ccs_frame_fd, CCS_FRAME_INTERVAL, false);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Utility functions - Latency statistics
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static unsigned long long ccs_usec_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+//Values below 16 get a bucket each, then 16 buckets per power of two
+static unsigned int ccs_hist_index(unsigned int value)
+{
+	int bits;
+	if (value < (1 << CCS_HIST_SUB_BITS))
+		return value;
+	bits = 31 - __builtin_clz(value);
+	return ((bits - CCS_HIST_SUB_BITS + 1) << CCS_HIST_SUB_BITS) +
+		((value >> (bits - CCS_HIST_SUB_BITS)) & ((1 << CCS_HIST_SUB_BITS) - 1));
+}
+
+//Highest value counted in bucket @index
+static unsigned int ccs_hist_value(unsigned int index)
+{
+	int bits;
+	unsigned int sub;
+	if (index < (1 << CCS_HIST_SUB_BITS))
+		return index;
+	bits = (index >> CCS_HIST_SUB_BITS) + CCS_HIST_SUB_BITS - 1;
+	sub = index & ((1 << CCS_HIST_SUB_BITS) - 1);
+	return (((1U << CCS_HIST_SUB_BITS) + sub) << (bits - CCS_HIST_SUB_BITS)) +
+		(1U << (bits - CCS_HIST_SUB_BITS)) - 1;
+}
+
+static void ccs_hist_add(struct ccs_histogram *hist, unsigned long long usec)
+{
+	const unsigned int value = usec > 0xFFFFFFFFULL ? 0xFFFFFFFF : usec;
+	if (!hist->count || value < hist->min)
+		hist->min = value;
+	if (value > hist->max)
+		hist->max = value;
+	hist->count++;
+	hist->sum += value;
+	hist->buckets[ccs_hist_index(value)]++;
+}
+
+static unsigned int ccs_hist_percentile(const struct ccs_histogram *hist,
+					double percentile)
+{
+	const unsigned long long target = hist->count * percentile / 100 + 0.999999;
+	unsigned long long seen = 0;
+	int i;
+	for (i = 0; i < CCS_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= target)
+			break;
 	}
-	free(buffer);
+	if (i == CCS_HIST_BUCKETS || ccs_hist_value(i) > hist->max)
+		return hist->max;
+	return ccs_hist_value(i);
+}
+
+static void ccs_hist_print(FILE *fp, const char *name,
+			   const struct ccs_histogram *hist)
+{
+	if (!hist->count)
+		return;
+	fprintf(fp, " %-14s %9llu %9u %9u %9u %9u %9u %9u %9llu\n", name,
+		hist->count, hist->min, ccs_hist_percentile(hist, 50),
+		ccs_hist_percentile(hist, 90), ccs_hist_percentile(hist, 99),
+		ccs_hist_percentile(hist, 99.9), hist->max,
+		hist->sum / hist->count);
+}
+
+//Time spent in @stage since @start
+static void ccs_stage_done(int stage, unsigned long long start)
+{
+	ccs_hist_add(&ccs_stage_hist[stage], ccs_usec_now() - start);
+}
+
+//On SIGUSR1 and at exit, to --stats=FILE (replaced) or else to the screen/log
+static void ccs_stats_dump(void)
+{
+	static const char * const stage_names[CCS_MAX_STAGE] = {
+		"read", "parse", "lookup", "prompt", "wait", "policy", "answer",
+	};
+	static const char * const source_names[CCS_MAX_JOURNAL_SOURCE] = {
+		"rule", "cache", "human", "timeout", "learn", "passthrough",
+		"failure", "provisional", "policy",
+	};
+	char *text = NULL;
+	size_t size = 0;
+	FILE *fp = open_memstream(&text, &size);
+	int i;
+	if (!fp)
+		return;
+	fprintf(fp, " %-14s %9s %9s %9s %9s %9s %9s %9s %9s\n", "usec", "count",
+		"min", "p50", "p90", "p99", "p99.9", "max", "mean");
+	for (i = 0; i < CCS_MAX_STAGE; i++)
+		ccs_hist_print(fp, stage_names[i], &ccs_stage_hist[i]);
+	for (i = 0; i < CCS_MAX_JOURNAL_SOURCE; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "total/%s", source_names[i]);
+		ccs_hist_print(fp, name, &ccs_source_hist[i]);
+	}
+	fclose(fp);
+	if (ccs_stats_file) {
+		char *tmp = ccs_malloc(strlen(ccs_stats_file) + 5);
+		int fd;
+		sprintf(tmp, "%s.tmp", ccs_stats_file);
+		fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd == EOF || write(fd, text, size) != size || close(fd) ||
+		    rename(tmp, ccs_stats_file)) {
+			ccs_printw(" Latency Statistics               = Can't write %s\n",
+				   ccs_stats_file);
+			if (fd != EOF)
+				unlink(tmp);
+		}
+		free(tmp);
+	} else {
+		ccs_printw("\n Latency Statistics :\n%s\n", text);
+	}
+	free(text);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -105,68 +640,9 @@ static void ccs_send_keepalive(void)
 // Utility functions - Popup Warning 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-static int popup_warning(const char *message, const char *timeout)
-{
-    char tmpmessage[2000] = "";
-    int result = 0;
-    strcat(tmpmessage, "(while ! wmctrl -F -a 'CCS-Tomoyo-Warning' -b add,above;do sleep 1;done) >/dev/null 2>&1 & ");
-    strcat(tmpmessage, "zenity --timeout ");
-    strcat(tmpmessage, timeout);
-    strcat(tmpmessage, " --warning --no-markup --width=250 --height=50 --ok-label='Ok (");
-    strcat(tmpmessage, timeout);
-    strcat(tmpmessage, "s)' ");
-    strcat(tmpmessage, "--title=CCS-Tomoyo-Query-Warning --text='");
-    strcat(tmpmessage, message);
-    strcat(tmpmessage, "' ");
-    strcat(tmpmessage, ">/dev/null 2>&1");
-    result = system(tmpmessage);
-    return result;
-}
-
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Utility functions - Extract Domain
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-static char * extract_domain(const char *ccs_buffer, const char *debugStr) 
+static void popup_warning(const char *message, const char *timeout)
 {
-    //Vars
-    int firstlinesize = 1;
-    int secondlinesize = 1;
-    extracted_domain[0] = '\0';
-
-    //Get First Line Position
-    while ((ccs_buffer[firstlinesize] != '\n') && (firstlinesize < 28500)) {
-        firstlinesize++;
-    } firstlinesize++;
-    
-    //Prepare Second Line
-    const char* secondlinePos = ccs_buffer + firstlinesize;
-
-    //Extract Domain With 3rd Line
-    strcat(extracted_domain, secondlinePos);
-
-    //Get Second Line Lenth
-    while ((extracted_domain[secondlinesize] != '\n') && (firstlinesize < 28500)) {
-        secondlinesize++;
-    }
-
-    //Clear Third Line 
-    extracted_domain[secondlinesize] = '\0'; //Insert a terminating null character 
-    
-    //Clear Third Line Old Code : not needed, null make pointeur kill the rest and break chain
-    //secondlinesize++; while ((domainString[secondlinesize] != '\n') && (firstlinesize < 28500)) {domainString[secondlinesize] = NULL;  //Or '\0'
-    //secondlinesize++;}
-    
-    if (strcmp(debugStr, "true") == 0) {
-        ccs_printw("\n");
-        ccs_printw(" Extracted Domain :\n");
-        ccs_printw(" %s\n", extracted_domain);
-        ccs_printw("\n");
-    } else {
-        ccs_printw(" Extracted Domain                 = Ok\n");
-    }
-    
-    return extracted_domain;
+    ccs_prompt(CCS_PROMPT_WARNING, message, timeout);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -226,7 +702,7 @@ static void cleanString(const char *ccs_buffer)
 // Utility functions - Prepare Main Question
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-static void prepare_main_question(const char *ccs_buffer, const char *timeout)
+static void prepare_main_question(const char *ccs_buffer)
 {
     //Clean message
     cleanString(ccs_buffer); //use ccs_buffer_cleaned afterward
@@ -234,89 +710,10 @@ static void prepare_main_question(const char *ccs_buffer, const char *timeout)
     //Vars
     message_question[0] = '\0';
     
-    //Prepare question
-    strcat(message_question, "(while ! wmctrl -F -a 'CCS-Tomoyo-Query' -b add,above;do sleep 1;done) >/dev/null 2>&1 & ");
-    strcat(message_question, "ans=$(zenity --timeout ");
-    strcat(message_question, timeout);
-    strcat(message_question, " ");
-    strcat(message_question, "--question --no-markup --width=675 --height=150 --ellipsize --switch ");
-    strcat(message_question, "--title=CCS-Tomoyo-Query ");
-    strcat(message_question, "--extra-button 'Allow & Learn' "); // >>>>>>>>>>>>>>>>                                  ------- A (add policy)
-    strcat(message_question, "--extra-button 'Allow All & Save' "); // >>>>>>>>>>>>> change_profile_policy to 2 + ccs ------- Y
-    //strcat(message_question, "--extra-button 'Allow All' "); // >>>>>>>>>>>>>>>>>>>> change_profile_policy to 2       ------- Y
-    strcat(message_question, "--extra-button 'Allow' "); // >>>>>>>>>>>>>>>>>>>>>>>>                                  ------- Y
-    strcat(message_question, "--extra-button 'Deny ("); // >>>>>>>>>>>>>>>>>>>>>>>>>                                  ------- N (deny)
-    strcat(message_question, timeout);
-    strcat(message_question, "s)' ");  
-    strcat(message_question, "--extra-button 'Deny All' "); // >>>>>>>>>>>>>>>>>>>>> change_profile_policy to 8       ------- N
-    strcat(message_question, "--text='Tomoyo :\n");
+    //Prepare question, the buttons are added by the prompt helper
+    strcat(message_question, "Tomoyo :\n");
     strcat(message_question, ccs_buffer_cleaned);
-    strcat(message_question, " ?' ");
-    strcat(message_question, "2>&1)");
-    
-    //Add bash suite
-    strcat(message_question, " ; level=$?");
-    strcat(message_question, " ; if [[ $ans = *\"Allow & Learn\"* ]]; then exit 100 ; fi "); // ------- 100  25600
-    strcat(message_question, " ; if [[ $ans = *\"Allow All & Save\"* ]]; then exit 200 ; fi "); // ---- 200  51200
-    strcat(message_question, " ; if [[ $ans = *\"Allow All\"* ]]; then exit 300 ; fi "); // ----------- 300  11264
-    strcat(message_question, " ; if [[ $ans = *\"Allow\"* ]]; then exit 400 ; fi "); // --------------- 400  36864
-    strcat(message_question, " ; if [[ $ans = *\"Deny All\"* ]]; then exit 500 ; fi "); // ------------ 500  62464
-    strcat(message_question, " ; if [[ $ans = *\"Deny (\"* ]]; then exit 600 ; fi "); // -------------- 600  22528
-    strcat(message_question, " ; if [ $level -eq 0 ]; then exit 1000 ; fi "); // ---------------------- 1000 59392 The zenity command worked
-    strcat(message_question, " ; if [ $level -eq 1 ]; then exit 1000 ; fi "); // ---------------------- 1000 59392 The zenity command worked
-    strcat(message_question, " ; if [ $level -eq 5 ]; then exit 2000 ; fi "); // ---------------------- 1000 53248 The zenity command timeout
-    strcat(message_question, " ; if [ $level -ne 1 ]; then exit 3000 ; fi ;"); // --------------------- 3000 47104 The main zenity command did not worked 
-}
-
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Utility functions - Popup Question
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-static int popup_question(const char *message, const char *timeout)
-{
-    char tmpmessage[2000] = "";
-    int result = 0;
-    
-    //Prepare question
-    strcat(tmpmessage, "(while ! wmctrl -F -a 'CCS-Tomoyo-Query' -b add,above;do sleep 1;done) >/dev/null 2>&1 & ");
-    strcat(tmpmessage, "ans=$(zenity --timeout ");
-    strcat(tmpmessage, timeout);
-    strcat(tmpmessage, " ");
-    strcat(tmpmessage, "--question --no-markup --width=250 --height=50 --switch ");
-    strcat(tmpmessage, "--title=CCS-Tomoyo-Query ");
-    strcat(tmpmessage, "--extra-button 'No (");
-    strcat(tmpmessage, timeout);
-    strcat(tmpmessage, "s)' ");
-    strcat(tmpmessage, "--extra-button 'Yes' ");
-    strcat(tmpmessage, "--text='");
-    strcat(tmpmessage, message);       
-    strcat(tmpmessage, "' ");
-    strcat(tmpmessage, "2>&1)");
-    
-    //Add bash suite
-    strcat(tmpmessage, " ; level=$?");
-    strcat(tmpmessage, " ; if [[ $ans = *\"Yes\"* ]]; then exit 100 ; fi "); // ----------------- 100  25600
-    strcat(tmpmessage, " ; if [[ $ans = *\"No (\"* ]]; then exit 200 ; fi "); // ---------------- 200  51200
-    strcat(tmpmessage, " ; if [ $level -eq 0 ]; then exit 1000 ; fi "); // ---------------------- 1000 59392 The zenity command worked
-    strcat(tmpmessage, " ; if [ $level -eq 1 ]; then exit 1000 ; fi "); // ---------------------- 1000 59392 The zenity command worked
-    strcat(tmpmessage, " ; if [ $level -eq 5 ]; then exit 2000 ; fi "); // ---------------------- 1000 53248 The zenity command timeout
-    strcat(tmpmessage, " ; if [ $level -ne 1 ]; then exit 3000 ; fi ;"); // --------------------- 3000 47104 The main zenity command did not worked  
-    
-    //Exec question
-    result = system(tmpmessage);
-    
-    //Result
-    ccs_printw("\n");
-    ccs_printw(" Question :\n");
-    ccs_printw(" Yes                              = 25600 \n");
-    ccs_printw(" No                               = 51200\n");
-    //ccs_printw(" Timeout                          = 53248\n");
-    ccs_printw(" ----------------------------------------\n");
-    ccs_printw(" Result                           = %d\n",result);
-    ccs_printw("\n");
-    
-    //Return result
-    return result;
+    strcat(message_question, " ?");
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -335,23 +732,19 @@ static int popup_question(const char *message, const char *timeout)
 // Utility functions - Save policy 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-static int save_policy(void)
+//Print what the background saver did, called from the event loop
+static void show_save_result(int xxresult)
 {
-    int xxresult = 0;
-
-    //Exec save
-    xxresult=system("ccs-savepolicy >/dev/null 2>&1");
-
     //Result
     ccs_printw("\n");
     ccs_printw(" Save Policy :\n");
-    ccs_printw(" Ok                               = 0 ?\n");
-    ccs_printw(" Nok                              = 256\n");
+    ccs_printw(" Files Saved                      = N\n");
+    ccs_printw(" Nok                              = -1\n");
     ccs_printw(" ----------------------------------------\n");
     ccs_printw(" Result                           = %d\n",xxresult);
     ccs_printw("\n");
 
-    if (xxresult != 0) {
+    if (xxresult < 0) {
         ccs_printw("\n");
         ccs_printw(" ----------------------------------------\n");
         ccs_printw("\nPolicy Saved                    = NOK !\n");
@@ -365,10 +758,86 @@ static int save_policy(void)
         ccs_printw(" ----------------------------------------\n");
         ccs_printw("\n");
     }
+}
 
-    //system("sleep 1 >/dev/null 2>&1"); //To be removed
-    
-    return xxresult;
+//Ask the background saver for a save, the query is answered without waiting for the disk
+static void save_policy(void)
+{
+    if (ccs_replay_fp) {
+        ccs_printw(" Save Policy                      = Skipped (replay)\n");
+        return;
+    }
+    pthread_mutex_lock(&ccs_saver_lock);
+    if (!ccs_saver_dirty)
+        clock_gettime(CLOCK_MONOTONIC, &ccs_saver_first_mark);
+    ccs_saver_dirty = true;
+    pthread_cond_signal(&ccs_saver_wake);
+    pthread_mutex_unlock(&ccs_saver_lock);
+    ccs_printw(" Save Policy                      = Queued\n");
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Utility functions - Background saver
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Saves requested within --save-delay of the first one are written together.
+// The result goes back to the event loop through ccs_saver_pipe.
+//
+
+static void *ccs_saver_main(void *unused)
+{
+	pthread_mutex_lock(&ccs_saver_lock);
+	while (true) {
+		struct timespec deadline;
+		int result;
+		while (!ccs_saver_dirty && !ccs_saver_stop)
+			pthread_cond_wait(&ccs_saver_wake, &ccs_saver_lock);
+		if (!ccs_saver_dirty)
+			break;
+		//Debounce, unless we are shutting down
+		deadline = ccs_saver_first_mark;
+		deadline.tv_sec += ccs_saver_delay / 1000;
+		deadline.tv_nsec += (ccs_saver_delay % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		while (!ccs_saver_stop &&
+			   pthread_cond_timedwait(&ccs_saver_wake, &ccs_saver_lock,
+									  &deadline) != ETIMEDOUT);
+		ccs_saver_dirty = false;
+		pthread_mutex_unlock(&ccs_saver_lock);
+		result = ccs_save_policy(CCS_DISK_POLICY_DIR);
+		write(ccs_saver_pipe[1], &result, sizeof(result));
+		pthread_mutex_lock(&ccs_saver_lock);
+	}
+	pthread_mutex_unlock(&ccs_saver_lock);
+	return NULL;
+}
+
+static _Bool ccs_saver_start(void)
+{
+	pthread_condattr_t attr;
+	if (pipe2(ccs_saver_pipe, O_CLOEXEC | O_NONBLOCK))
+		return false;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ccs_saver_wake, &attr);
+	pthread_condattr_destroy(&attr);
+	return !pthread_create(&ccs_saver_thread, NULL, ccs_saver_main, NULL);
+}
+
+//Write out a pending save now and wait for it
+static void ccs_saver_flush(void)
+{
+	int result;
+	pthread_mutex_lock(&ccs_saver_lock);
+	ccs_saver_stop = true;
+	pthread_cond_signal(&ccs_saver_wake);
+	pthread_mutex_unlock(&ccs_saver_lock);
+	pthread_join(ccs_saver_thread, NULL);
+	if (read(ccs_saver_pipe[0], &result, sizeof(result)) == sizeof(result) && result < 0)
+		fprintf(stderr, "Failed to save policy.\n");
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -390,120 +859,1822 @@ static int save_policy(void)
 // Utility functions - Send notification
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-static int send_notification(const char *ccs_buffer)
+static void send_notification(const char *ccs_buffer)
 {        
-    int result = 0;
     char messagenotify[32768] = "";
     
     //Clean message
     cleanString(ccs_buffer); //use ccs_buffer_cleaned afterward
     
-    //Prepare norification - Get current x use 
-    strcat(messagenotify, "sudo -u $(ps auxw | grep -i screen | grep -v grep | cut -f 1 -d ' ') ");
-    strcat(messagenotify, "notify-send -a Tomoyo -i cs-firewall Tomoyo '");
+    //Prepare notification, the prompt helper sends it to the desktop user
     strcat(messagenotify, ccs_buffer_cleaned);
-    strcat(messagenotify, " ?' >/dev/null 2>&1");
+    strcat(messagenotify, " ?");
     
     //Send notification
-    result = system(messagenotify);
+    ccs_prompt(CCS_PROMPT_NOTIFY, messagenotify, "0");
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Utility functions - Domain policy mirror
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// ccs_domain_mirror is domain_policy as read at startup (and again on SIGHUP)
+// plus every line and profile written since, looked up without asking the kernel.
+// Domainnames and lines are ccs_savename()'d, so they compare by address.
+//
+
+static void ccs_mirror_load(void)
+{
+	ccs_clear_domain_policy(&ccs_domain_mirror);
+	ccs_read_domain_policy(&ccs_domain_mirror, CCS_PROC_POLICY_DOMAIN_POLICY);
+}
+
+//Index of @domain, added if missing, EOF if not a valid domainname
+static int ccs_mirror_domain(const struct ccs_path_info *domain)
+{
+	const int index = ccs_find_domain_by_ptr(&ccs_domain_mirror, domain);
+	if (index != EOF || !ccs_correct_domain(domain->name))
+		return index;
+	return ccs_assign_domain(&ccs_domain_mirror, domain->name);
+}
+
+//Is @acl in @domain's policy, or queued for it?
+static _Bool ccs_mirror_has(const struct ccs_path_info *domain,
+			    const struct ccs_path_info *acl)
+{
+	const int index = ccs_find_domain_by_ptr(&ccs_domain_mirror, domain);
+	const struct ccs_domain_info *ptr;
+	int i;
+	if (index == EOF)
+		return false;
+	ptr = &ccs_domain_mirror.list[index];
+	for (i = 0; i < ptr->string_count; i++)
+		if (ptr->string_ptr[i] == acl)
+			return true;
+	return false;
+}
+
+static void ccs_mirror_set_profile(const struct ccs_path_info *domain,
+				   const unsigned int profile)
+{
+	const int index = ccs_mirror_domain(domain);
+	if (index == EOF)
+		return;
+	ccs_domain_mirror.list[index].profile = profile;
+	ccs_domain_mirror.list[index].profile_assigned = true;
+}
+
+static void ccs_mirror_show(const struct ccs_path_info *domain)
+{
+	const int index = ccs_find_domain_by_ptr(&ccs_domain_mirror, domain);
+	const struct ccs_domain_info *ptr;
+	int i;
+	ccs_printw("%s\n", domain->name);
+	if (index == EOF) {
+		ccs_printw("\n(not in domain_policy)\n\n");
+		return;
+	}
+	ptr = &ccs_domain_mirror.list[index];
+	if (ptr->profile_assigned)
+		ccs_printw("use_profile %u\n", ptr->profile);
+	ccs_printw("\n");
+	for (i = 0; i < ptr->string_count; i++)
+		ccs_printw("%s\n", ptr->string_ptr[i]->name);
+	ccs_printw("\n");
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Utility functions - Insert policy 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void change_profile_policy(const struct ccs_path_info *domain, const unsigned int profile, const char *doSave)
+{
+    _Bool ok;
+    unsigned long long start;
+
+    ccs_printw("\n");
+    ccs_printw(" Extracted Domain :\n");
+    ccs_printw(" %s\n", domain->name);
+
+    ccs_printw("\n");
+    ccs_printw(" Editing Profile Policy :\n");
+    ccs_printw(" use_profile %u\n", profile);
+    ccs_printw("\n");
+    
+    //use_profile profile
+    start = ccs_usec_now();
+    ok = ccs_replay_fp || ccs_set_profile(domain->name, profile);
+    ccs_stage_done(CCS_STAGE_POLICY, start);
+    if (!ok) {
+        popup_warning("Tomoyo Allow-All : Failed to save policy !","45");
+    } else {
+        ccs_mirror_set_profile(domain, profile);
+    }
+    ccs_decision_forget_domain(domain);
+
+    //Result
+    ccs_printw("\n");
+    ccs_printw(" Edit Profile Policy :\n");
+    ccs_printw(" ------------------------------------\n");
+    if (ok)
+        ccs_printw(" Result                       = Ok\n");
+    else
+        ccs_printw(" Result                       = Nok (%s)\n", strerror(errno));
+    ccs_printw("\n");
     
-    return result;
+    //Save policy
+    if (strcmp(doSave, "true") == 0) {
+        save_policy();
+    } //else {
+        //save_policy_question();
+    //}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Utility functions - Query parser
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Q<serial>-<retry>
+// #<timestamp># profile=<n> mode=<mode> ... (global-pid=<n>) task={ pid=<n> ppid=<n> ... } ...
+// <domainname>
+// <ACL line>
+//
+
+//Slice of @line (of @len bytes) following @key up to the next @delim
+static struct ccs_slice ccs_find_field(const char *line, int len,
+				       const char *key, const char *delim)
+{
+	struct ccs_slice slice = { NULL, 0 };
+	const int key_len = strlen(key);
+	const char *cp = line ? memmem(line, len, key, key_len) : NULL;
+	const char *end;
+	if (!cp)
+		return slice;
+	cp += key_len;
+	end = memmem(cp, line + len - cp, delim, strlen(delim));
+	slice.ptr = cp;
+	slice.len = (end ? end : line + len) - cp;
+	return slice;
+}
+
+static unsigned int ccs_slice_uint(struct ccs_slice slice)
+{
+	return slice.ptr ? strtoul(slice.ptr, NULL, 10) : 0;
+}
+
+//Tokenize @record in place. Only the trailing newline is modified.
+static _Bool ccs_parse_query(char *record, struct ccs_query_info *q)
+{
+	char *text;
+	char *end;
+	char *cp;
+	struct ccs_slice field;
+	memset(q, 0, sizeof(*q));
+	if (sscanf(record, "Q%u-%hu", &q->serial, &q->retry) != 2)
+		return false;
+	text = strchr(record, '\n');
+	if (!text++)
+		return false;
+	end = text + strlen(text);
+	if (end == text)
+		return false;
+	if (*(end - 1) == '\n')
+		*--end = '\0';
+	q->text = text;
+
+	/* Header line. */
+	cp = strchr(text, '\n');
+	q->header.ptr = text;
+	q->header.len = (cp ? cp : end) - text;
+	if (*text == '#')
+		q->timestamp = ccs_find_field(text, q->header.len, "#", "#");
+	q->mode = ccs_find_field(text, q->header.len, " mode=", " ");
+	q->task = ccs_find_field(text, q->header.len, "task={ ", " }");
+	field = ccs_find_field(text, q->header.len, "(global-pid=", ")");
+	if (!field.ptr)
+		return false;
+	q->global_pid = ccs_slice_uint(field);
+	q->profile = ccs_slice_uint(ccs_find_field(text, q->header.len, "profile=", " "));
+	q->pid = ccs_slice_uint(ccs_find_field(q->task.ptr, q->task.len, "pid=", " "));
+	q->ppid = ccs_slice_uint(ccs_find_field(q->task.ptr, q->task.len, "ppid=", " "));
+
+	/* Domainname and ACL line. */
+	q->is_domain_query = cp && !strstr(text, "\n#");
+	if (!q->is_domain_query)
+		return true;
+	text = cp + 1;
+	cp = strchr(text, '\n');
+	if (!cp)
+		return false;
+	*cp = '\0';
+	q->domain = ccs_savename(text);
+	*cp = '\n';
+	q->acl = cp + 1;
+	return true;
+}
+
+//Copy of @src that owns its text, for queries that outlive the read buffer
+static void ccs_copy_query(struct ccs_query_info *dst,
+			   const struct ccs_query_info *src)
+{
+	const char *text = ccs_strdup(src->text);
+	const long offset = text - src->text;
+	*dst = *src;
+	dst->text = text;
+	dst->header.ptr += offset;
+	if (dst->timestamp.ptr)
+		dst->timestamp.ptr += offset;
+	if (dst->mode.ptr)
+		dst->mode.ptr += offset;
+	if (dst->task.ptr)
+		dst->task.ptr += offset;
+	if (dst->acl)
+		dst->acl += offset;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Utility functions - Decision cache
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static time_t ccs_monotonic_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static unsigned int ccs_decision_index(const struct ccs_path_info *domain,
+				       const struct ccs_path_info *acl)
+{
+	return (domain->hash * 31 + acl->hash) % CCS_DECISION_HASH;
+}
+
+static void ccs_decision_unlink(struct ccs_decision *ptr)
+{
+	struct ccs_decision **pp =
+		&ccs_decision_hash[ccs_decision_index(ptr->domain, &ptr->acl)];
+	while (*pp != ptr)
+		pp = &(*pp)->hash_next;
+	*pp = ptr->hash_next;
+	if (ptr->lru_prev)
+		ptr->lru_prev->lru_next = ptr->lru_next;
+	else
+		ccs_decision_lru_head = ptr->lru_next;
+	if (ptr->lru_next)
+		ptr->lru_next->lru_prev = ptr->lru_prev;
+	else
+		ccs_decision_lru_tail = ptr->lru_prev;
+	ccs_decision_count--;
+	free((void *) ptr->acl.name);
+	free(ptr);
+}
+
+static void ccs_decision_push_front(struct ccs_decision *ptr)
+{
+	ptr->lru_prev = NULL;
+	ptr->lru_next = ccs_decision_lru_head;
+	if (ccs_decision_lru_head)
+		ccs_decision_lru_head->lru_prev = ptr;
+	else
+		ccs_decision_lru_tail = ptr;
+	ccs_decision_lru_head = ptr;
+}
+
+static struct ccs_decision *ccs_decision_lookup(const struct ccs_path_info *domain,
+						const char *acl_line)
+{
+	struct ccs_path_info acl;
+	struct ccs_decision *ptr;
+	acl.name = acl_line;
+	ccs_fill_path_info(&acl);
+	for (ptr = ccs_decision_hash[ccs_decision_index(domain, &acl)]; ptr;
+	     ptr = ptr->hash_next) {
+		if (ptr->domain != domain || ccs_pathcmp(&ptr->acl, &acl))
+			continue;
+		if (ptr->expires <= ccs_monotonic_now()) {
+			ccs_decision_unlink(ptr);
+			return NULL;
+		}
+		//Move to the front of the LRU list
+		if (ptr != ccs_decision_lru_head) {
+			ptr->lru_prev->lru_next = ptr->lru_next;
+			if (ptr->lru_next)
+				ptr->lru_next->lru_prev = ptr->lru_prev;
+			else
+				ccs_decision_lru_tail = ptr->lru_prev;
+			ccs_decision_push_front(ptr);
+		}
+		return ptr;
+	}
+	return NULL;
+}
+
+//@age: Seconds since the answer was given
+static void ccs_decision_store(const struct ccs_path_info *domain,
+			       const char *acl_line, int answer, time_t age)
+{
+	struct ccs_decision *ptr = ccs_decision_lookup(domain, acl_line);
+	unsigned int index;
+	if (ccs_decision_capacity <= 0)
+		return;
+	if (!ptr) {
+		while (ccs_decision_count >= ccs_decision_capacity)
+			ccs_decision_unlink(ccs_decision_lru_tail);
+		ptr = ccs_malloc(sizeof(*ptr));
+		ptr->domain = domain;
+		ptr->acl.name = ccs_strdup(acl_line);
+		ccs_fill_path_info(&ptr->acl);
+		index = ccs_decision_index(domain, &ptr->acl);
+		ptr->hash_next = ccs_decision_hash[index];
+		ccs_decision_hash[index] = ptr;
+		ccs_decision_push_front(ptr);
+		ccs_decision_count++;
+	}
+	ptr->answer = answer;
+	ptr->expires = ccs_monotonic_now() - age + (answer == 'Y' ?
+		ccs_decision_allow_ttl : ccs_decision_deny_ttl);
+}
+
+//Cached answers no longer apply once the domain's profile was changed
+static void ccs_decision_forget_domain(const struct ccs_path_info *domain)
+{
+	struct ccs_decision *ptr = ccs_decision_lru_head;
+	while (ptr) {
+		struct ccs_decision *next = ptr->lru_next;
+		if (ptr->domain == domain)
+			ccs_decision_unlink(ptr);
+		ptr = next;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Utility functions - Rules
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// The rules file looks like domain policy. A domainname line (patterns
+// allowed) starts a section, "allow" and "deny" lines below it give the
+// answer for matching ACL lines. '#' starts a comment.
+//
+//   <kernel> /usr/sbin/httpd
+//   allow network inet stream bind 0.0.0.0 80
+//   deny file write /etc/\*
+//
+//   <kernel> /\{\*\}/\*
+//   deny file read /etc/shadow
+//
+
+static _Bool ccs_load_rules(const char *filename)
+{
+	const struct ccs_path_info *domain = NULL;
+	FILE *fp = fopen(filename, "r");
+	int line_no = 0;
+	if (!fp) {
+		fprintf(stderr, "Can't open %s\n", filename);
+		return false;
+	}
+	ccs_get();
+	while (true) {
+		char *line = ccs_freadline(fp);
+		int answer;
+		if (!line)
+			break;
+		line_no++;
+		if (!*line || *line == '#')
+			continue;
+		if (ccs_domain_def(line)) {
+			domain = ccs_savename(line);
+			continue;
+		}
+		if (ccs_str_starts(line, "allow "))
+			answer = 'Y';
+		else if (ccs_str_starts(line, "deny "))
+			answer = 'N';
+		else
+			goto bad_line;
+		if (!domain || !*line)
+			goto bad_line;
+		ccs_rule_list = ccs_realloc(ccs_rule_list, (ccs_rule_list_len + 1) *
+					    sizeof(struct ccs_rule));
+		ccs_rule_list[ccs_rule_list_len].domain = domain;
+		ccs_rule_list[ccs_rule_list_len].acl = ccs_savename(line);
+		ccs_rule_list[ccs_rule_list_len++].answer = answer;
+		continue;
+bad_line:
+		fprintf(stderr, "%s:%d: Invalid rule.\n", filename, line_no);
+		ccs_put();
+		fclose(fp);
+		return false;
+	}
+	ccs_put();
+	fclose(fp);
+	return true;
+}
+
+//Returns 'Y' or 'N' if a rule answers the query, 0 otherwise
+static int ccs_match_rules(const struct ccs_path_info *domain,
+			   const char *acl_line)
+{
+	struct ccs_path_info acl;
+	int i;
+	if (!ccs_rule_list_len)
+		return 0;
+	acl.name = acl_line;
+	ccs_fill_path_info(&acl);
+	for (i = 0; i < ccs_rule_list_len; i++) {
+		const struct ccs_rule *ptr = &ccs_rule_list[i];
+		if (ccs_path_matches_pattern(domain, ptr->domain) &&
+		    ccs_path_matches_pattern(&acl, ptr->acl))
+			return ptr->answer;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Utility functions - Decision journal
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Every answer is appended to --journal=FILE in the format ccs_journal_scan()
+// reads. The event loop only copies records into ccs_journal_ring, the writer
+// thread moves them to the file. One producer and one consumer, so the head and
+// tail counters are all the synchronization needed.
+//
+
+//Where a prompt result comes from, for answers made by ccs_finish_query()
+static int ccs_journal_source(int xresult, _Bool from_prompt)
+{
+	if (xresult == 256)
+		return CCS_JOURNAL_PASSTHROUGH;
+	if (xresult == 53248)
+		return CCS_JOURNAL_TIMEOUT;
+	if (xresult == 47104 || xresult == 59392)
+		return CCS_JOURNAL_FAILURE;
+	return from_prompt ? CCS_JOURNAL_HUMAN : CCS_JOURNAL_LEARN;
+}
+
+static struct ccs_journal_id **ccs_journal_id_slot(const struct ccs_path_info *name)
+{
+	struct ccs_journal_id **pp = &ccs_journal_ids[name->hash % CCS_JOURNAL_ID_HASH];
+	while (*pp && (*pp)->name != name)
+		pp = &(*pp)->next;
+	return pp;
+}
+
+static unsigned long ccs_journal_name_size(const struct ccs_path_info *name)
+{
+	return (sizeof(struct ccs_journal_name) + name->total_len + 1 + 7) & ~7UL;
+}
+
+static void ccs_journal_copy(unsigned long pos, const void *data, unsigned long len)
+{
+	const unsigned long start = pos % CCS_JOURNAL_RING;
+	const unsigned long first = len < CCS_JOURNAL_RING - start ?
+		len : CCS_JOURNAL_RING - start;
+	memcpy(ccs_journal_ring + start, data, first);
+	memcpy(ccs_journal_ring, (const char *) data + first, len - first);
+}
+
+static void ccs_journal_peek(unsigned long pos, void *data, unsigned long len)
+{
+	const unsigned long start = pos % CCS_JOURNAL_RING;
+	const unsigned long first = len < CCS_JOURNAL_RING - start ?
+		len : CCS_JOURNAL_RING - start;
+	memcpy(data, ccs_journal_ring + start, first);
+	memcpy((char *) data + first, ccs_journal_ring, len - first);
+}
+
+//Define an id for a name the journal has not seen yet
+static unsigned long ccs_journal_put_name(unsigned long pos,
+					  const struct ccs_path_info *name)
+{
+	static const char zero[8];
+	struct ccs_journal_id *ptr = ccs_malloc(sizeof(*ptr));
+	struct ccs_journal_id **pp = ccs_journal_id_slot(name);
+	struct ccs_journal_name head;
+	const unsigned long size = ccs_journal_name_size(name);
+	ptr->next = NULL;
+	ptr->name = name;
+	ptr->id = ccs_journal_next_id++;
+	*pp = ptr;
+	head.head.length = size;
+	head.head.type = CCS_JOURNAL_NAME;
+	head.id = ptr->id;
+	ccs_journal_copy(pos, &head, sizeof(head));
+	ccs_journal_copy(pos + sizeof(head), name->name, name->total_len);
+	ccs_journal_copy(pos + sizeof(head) + name->total_len, zero,
+			 size - sizeof(head) - name->total_len);
+	return pos + size;
+}
+
+//Queue the answer to @q, never waits for the writer
+static void ccs_journal_decision(const struct ccs_query_info *q, int verdict,
+				 int source, int result,
+				 unsigned long long latency)
+{
+	const struct ccs_path_info *names[2] = { NULL, NULL };
+	struct ccs_journal_decision rec;
+	struct timespec real;
+	unsigned long size = sizeof(rec);
+	unsigned long pos = ccs_journal_head;
+	int i;
+	if (ccs_journal_fd == EOF)
+		return;
+	if (q->is_domain_query) {
+		names[0] = q->domain;
+		names[1] = ccs_savename(q->acl);
+	}
+	for (i = 0; i < 2; i++)
+		if (names[i] && !*ccs_journal_id_slot(names[i]))
+			size += ccs_journal_name_size(names[i]);
+	//Names go with the decision or not at all
+	if (size > CCS_JOURNAL_RING -
+	    (pos - __atomic_load_n(&ccs_journal_tail, __ATOMIC_ACQUIRE))) {
+		ccs_journal_dropped++;
+		return;
+	}
+	for (i = 0; i < 2; i++)
+		if (names[i] && !*ccs_journal_id_slot(names[i]))
+			pos = ccs_journal_put_name(pos, names[i]);
+	clock_gettime(CLOCK_REALTIME, &real);
+	if (latency > 0xFFFFFFFFULL)
+		latency = 0xFFFFFFFFULL;
+	memset(&rec, 0, sizeof(rec));
+	rec.head.length = sizeof(rec);
+	rec.head.type = CCS_JOURNAL_DECISION;
+	rec.serial = q->serial;
+	rec.domain = names[0] ? (*ccs_journal_id_slot(names[0]))->id : 0;
+	rec.acl = names[1] ? (*ccs_journal_id_slot(names[1]))->id : 0;
+	rec.latency_us = latency;
+	rec.answered_us = real.tv_sec * 1000000ULL + real.tv_nsec / 1000;
+	rec.received_us = rec.answered_us - rec.latency_us;
+	rec.verdict = verdict;
+	rec.source = source;
+	rec.result = result;
+	rec.pid = q->global_pid;
+	ccs_journal_copy(pos, &rec, sizeof(rec));
+	__atomic_store_n(&ccs_journal_head, pos + sizeof(rec), __ATOMIC_RELEASE);
+}
+
+//After a failed write of the @len bytes at the tail, of which @written reached
+//the file at @size, cut the file back to the last whole record. Returns how
+//many decisions are lost.
+static unsigned long ccs_journal_cut(off_t size, unsigned long written,
+				     unsigned long len)
+{
+	unsigned long keep = 0;
+	unsigned long lost = 0;
+	unsigned long pos = 0;
+	while (pos < len) {
+		struct ccs_journal_header head;
+		ccs_journal_peek(ccs_journal_tail + pos, &head, sizeof(head));
+		pos += head.length;
+		if (pos <= written)
+			keep = pos;
+		else if (head.type == CCS_JOURNAL_DECISION)
+			lost++;
+	}
+	if (size != -1 && keep < written)
+		ftruncate(ccs_journal_fd, size + keep);
+	return lost;
+}
+
+static void *ccs_journal_main(void *unused)
+{
+	while (true) {
+		const _Bool stop = __atomic_load_n(&ccs_journal_stop, __ATOMIC_ACQUIRE);
+		const unsigned long head = __atomic_load_n(&ccs_journal_head, __ATOMIC_ACQUIRE);
+		const unsigned long start = ccs_journal_tail % CCS_JOURNAL_RING;
+		const unsigned long len = head - ccs_journal_tail;
+		unsigned long written = 0;
+		struct iovec iov[2];
+		int count = 1;
+		off_t size;
+		if (!len) {
+			struct timespec delay = { 0, CCS_JOURNAL_INTERVAL * 1000000 };
+			if (stop)
+				break;
+			nanosleep(&delay, NULL);
+			continue;
+		}
+		iov[0].iov_base = ccs_journal_ring + start;
+		iov[0].iov_len = len;
+		if (start + len > CCS_JOURNAL_RING) {
+			iov[0].iov_len = CCS_JOURNAL_RING - start;
+			iov[1].iov_base = ccs_journal_ring;
+			iov[1].iov_len = len - iov[0].iov_len;
+			count = 2;
+		}
+		size = lseek(ccs_journal_fd, 0, SEEK_END);
+		while (count) {
+			ssize_t done = writev(ccs_journal_fd, iov, count);
+			if (done < 0 && errno == EINTR)
+				continue;
+			if (done <= 0)
+				break;
+			written += done;
+			while (count && done >= iov[0].iov_len) {
+				done -= iov[0].iov_len;
+				iov[0] = iov[1];
+				count--;
+			}
+			if (count) {
+				iov[0].iov_base = (char *) iov[0].iov_base + done;
+				iov[0].iov_len -= done;
+			}
+		}
+		//Not retried, a full disk would keep failing
+		if (written < len)
+			ccs_journal_lost += ccs_journal_cut(size, written, len);
+		__atomic_store_n(&ccs_journal_tail, head, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+//Answers still valid are put back into the decision cache
+static _Bool ccs_journal_warm(const struct ccs_journal_entry *entry, void *now)
+{
+	const struct ccs_journal_decision *rec = entry->record;
+	const struct ccs_path_info *domain;
+	const int answer = (rec->verdict == 2) ? 'N' : 'Y';
+	const long long age = (long long) (*(u64 *) now - rec->answered_us) / 1000000;
+	//Names written from now on get ids the file has not used yet
+	if (rec->domain >= ccs_journal_next_id)
+		ccs_journal_next_id = rec->domain + 1;
+	if (rec->acl >= ccs_journal_next_id)
+		ccs_journal_next_id = rec->acl + 1;
+	if (!entry->domainname || !entry->acl || rec->verdict == 3 ||
+	    rec->source != CCS_JOURNAL_HUMAN || ccs_decision_capacity <= 0)
+		return true;
+	domain = ccs_savename(entry->domainname);
+	//Allow All / Deny All / Allow All & Save changed the profile
+	if (rec->result == 11264 || rec->result == 62464 || rec->result == 51200)
+		ccs_decision_forget_domain(domain);
+	if (age < (answer == 'Y' ? ccs_decision_allow_ttl : ccs_decision_deny_ttl))
+		ccs_decision_store(domain, entry->acl, answer, age > 0 ? age : 0);
+	return true;
+}
+
+static _Bool ccs_journal_open(const char *filename)
+{
+	struct timespec real;
+	struct stat buf;
+	u64 now;
+	clock_gettime(CLOCK_REALTIME, &real);
+	now = real.tv_sec * 1000000ULL + real.tv_nsec / 1000;
+	if (!access(filename, F_OK) &&
+	    ccs_journal_scan(filename, ccs_journal_warm, &now) < 0) {
+		fprintf(stderr, "%s is not a decision journal.\n", filename);
+		return false;
+	}
+	ccs_journal_fd = open(filename, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	if (ccs_journal_fd == EOF || fstat(ccs_journal_fd, &buf) ||
+	    (!buf.st_size && write(ccs_journal_fd, CCS_JOURNAL_MAGIC,
+				   sizeof(CCS_JOURNAL_MAGIC) - 1) !=
+	     sizeof(CCS_JOURNAL_MAGIC) - 1)) {
+		fprintf(stderr, "Can't open %s for writing.\n", filename);
+		return false;
+	}
+	ccs_journal_ring = ccs_malloc(CCS_JOURNAL_RING);
+	return true;
+}
+
+static _Bool ccs_journal_start(void)
+{
+	if (ccs_journal_fd == EOF)
+		return true;
+	return !pthread_create(&ccs_journal_thread, NULL, ccs_journal_main, NULL);
+}
+
+//Write out what is queued and stop the writer
+static void ccs_journal_flush(void)
+{
+	if (ccs_journal_fd == EOF)
+		return;
+	__atomic_store_n(&ccs_journal_stop, true, __ATOMIC_RELEASE);
+	pthread_join(ccs_journal_thread, NULL);
+	fsync(ccs_journal_fd);
+	if (ccs_journal_dropped)
+		fprintf(stderr, "%lu decisions were not journaled.\n", ccs_journal_dropped);
+	if (ccs_journal_lost)
+		fprintf(stderr, "%lu decisions were lost writing the journal.\n",
+			ccs_journal_lost);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Utility functions - Learned lines
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//Write the queued lines with one write(), each domain selected once
+static void ccs_learn_flush(void)
+{
+	unsigned long long start;
+	_Bool written;
+	int size = 0;
+	int len = 0;
+	char *buf;
+	int i;
+	int j;
+	if (!ccs_learn_queue_len)
+		return;
+	for (i = 0; i < ccs_learn_queue_len; i++)
+		size += ccs_learn_queue[i]->domain->total_len +
+			ccs_learn_queue[i]->line->total_len + 32;
+	buf = ccs_malloc(size);
+	for (i = 0; i < ccs_learn_queue_len; i++) {
+		const struct ccs_path_info *domain;
+		if (!ccs_learn_queue[i])
+			continue;
+		domain = ccs_learn_queue[i]->domain;
+		len += sprintf(buf + len, "select domain=%s\n", domain->name);
+		for (j = i; j < ccs_learn_queue_len; j++) {
+			if (!ccs_learn_queue[j] ||
+			    ccs_learn_queue[j]->domain != domain)
+				continue;
+			len += sprintf(buf + len, "%s\n",
+				       ccs_learn_queue[j]->line->name);
+			free(ccs_learn_queue[j]);
+			ccs_learn_queue[j] = NULL;
+		}
+	}
+	start = ccs_usec_now();
+	if (ccs_network_mode)
+		written = ccs_agent_write(CCS_PROC_POLICY_DOMAIN_POLICY, buf, len);
+	else
+		written = write(ccs_domain_policy_fd, buf, len) == len;
+	ccs_stage_done(CCS_STAGE_POLICY, start);
+	free(buf);
+	if (written)
+		ccs_printw(" Learned Lines Written            = %d\n", ccs_learn_queue_len);
+	else
+		ccs_printw(" Learned Lines                    = Not written (%s)\n",
+			   strerror(errno));
+	ccs_learn_queue_len = 0;
+	ccs_arm_timer(ccs_learn_fd, 0, false);
+}
+
+static void ccs_learn_queue_add(const struct ccs_path_info *domain,
+				const struct ccs_path_info *acl)
+{
+	struct ccs_learned_line *ptr = ccs_malloc(sizeof(*ptr));
+	ptr->domain = domain;
+	ptr->line = acl;
+	ccs_learn_queue = ccs_realloc(ccs_learn_queue, (ccs_learn_queue_len + 1) *
+				      sizeof(struct ccs_learned_line *));
+	ccs_learn_queue[ccs_learn_queue_len++] = ptr;
+	if (ccs_learn_queue_len == 1)
+		ccs_arm_timer(ccs_learn_fd, CCS_LEARN_FLUSH_INTERVAL, false);
+	if (ccs_learn_queue_len >= CCS_LEARN_BATCH)
+		ccs_learn_flush();
+}
+
+//Take back a line not written yet, false if it was
+static _Bool ccs_learn_unqueue(const struct ccs_path_info *domain,
+			       const struct ccs_path_info *acl)
+{
+	int i;
+	for (i = 0; i < ccs_learn_queue_len; i++) {
+		if (ccs_learn_queue[i]->domain != domain ||
+		    ccs_learn_queue[i]->line != acl)
+			continue;
+		free(ccs_learn_queue[i]);
+		memmove(&ccs_learn_queue[i], &ccs_learn_queue[i + 1],
+			(--ccs_learn_queue_len - i) * sizeof(struct ccs_learned_line *));
+		if (!ccs_learn_queue_len)
+			ccs_arm_timer(ccs_learn_fd, 0, false);
+		return true;
+	}
+	return false;
+}
+
+//Queue @line for @domain, returns false if the policy already has it
+static _Bool ccs_learn_line(const struct ccs_path_info *domain, const char *line)
+{
+	const struct ccs_path_info *acl = ccs_savename(line);
+	int index;
+	if (ccs_mirror_has(domain, acl) || ccs_generalized_covers(domain, line))
+		return false;
+	index = ccs_mirror_domain(domain);
+	if (index != EOF)
+		ccs_add_string_entry(&ccs_domain_mirror, line, index);
+	ccs_learn_queue_add(domain, acl);
+	if (ccs_generalize_min)
+		ccs_generalize(domain, acl);
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Utility functions - Generalization
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Learned paths are grouped per domain, operation and rest of the line. When a
+// pattern built from a new path and one seen before covers --generalize=N of
+// the group's paths (checked with ccs_path_matches_pattern()), the pattern is
+// learned and the literal lines it covers are dropped from the queue or deleted.
+//
+
+//"file read /path rest" -> "file read", "/path", "rest". False if there is no path.
+static _Bool ccs_split_acl(char *line, char **path, char **tail)
+{
+	char *cp = line;
+	if (strncmp(line, "file ", 5))
+		return false;
+	while ((cp = strchr(cp, ' ')) != NULL) {
+		*cp++ = '\0';
+		if (*cp == '/')
+			break;
+		cp[-1] = ' ';
+	}
+	if (!cp)
+		return false;
+	*path = cp;
+	cp = strchr(cp, ' ');
+	if (cp)
+		*cp++ = '\0';
+	*tail = cp ? cp : "";
+	return true;
+}
+
+//@op, @path and @tail joined back into an ACL line
+static const struct ccs_path_info *ccs_join_acl(const char *op, const char *path,
+						const char *tail)
+{
+	const struct ccs_path_info *acl;
+	char *line = ccs_malloc(strlen(op) + strlen(path) + strlen(tail) + 3);
+	sprintf(line, "%s %s%s%s", op, path, *tail ? " " : "", tail);
+	acl = ccs_savename(line);
+	free(line);
+	return acl;
+}
+
+static struct ccs_learn_group *ccs_learn_group(const struct ccs_path_info *domain,
+					       const struct ccs_path_info *operation,
+					       const struct ccs_path_info *tail)
+{
+	struct ccs_learn_group *ptr;
+	int i;
+	for (i = 0; i < ccs_learn_groups_len; i++) {
+		ptr = &ccs_learn_groups[i];
+		if (ptr->domain == domain && ptr->operation == operation &&
+		    ptr->tail == tail)
+			return ptr;
+	}
+	ccs_learn_groups = ccs_realloc(ccs_learn_groups, (ccs_learn_groups_len + 1) *
+				       sizeof(struct ccs_learn_group));
+	ptr = &ccs_learn_groups[ccs_learn_groups_len++];
+	memset(ptr, 0, sizeof(*ptr));
+	ptr->domain = domain;
+	ptr->operation = operation;
+	ptr->tail = tail;
+	return ptr;
+}
+
+static _Bool ccs_all_chars(const char *str, int len, int (*is_class) (int))
+{
+	int i;
+	for (i = 0; i < len; i++)
+		if (!is_class((unsigned char) str[i]))
+			return false;
+	return len > 0;
+}
+
+static _Bool ccs_has_digit(const char *str, int len)
+{
+	int i;
+	for (i = 0; i < len; i++)
+		if (isdigit((unsigned char) str[i]))
+			return true;
+	return false;
+}
+
+//Pattern for one path component covering @a and @b, NULL if none is safe
+static char *ccs_generalize_name(const char *a, int la, const char *b, int lb)
+{
+	static int (* const classes[2]) (int) = { isdigit, isxdigit };
+	static const char * const wildcards[2] = { "\\$", "\\X" };
+	char *name;
+	int prefix = 0;
+	int suffix = 0;
+	int i;
+	if (la == lb && !strncmp(a, b, la)) {
+		name = ccs_malloc(la + 1);
+		memcpy(name, a, la);
+		name[la] = '\0';
+		return name;
+	}
+	//Escaped characters would be cut in half
+	if (memchr(a, '\\', la) || memchr(b, '\\', lb))
+		return NULL;
+	while (prefix < la && prefix < lb && a[prefix] == b[prefix])
+		prefix++;
+	while (suffix < la - prefix && suffix < lb - prefix &&
+	       a[la - suffix - 1] == b[lb - suffix - 1])
+		suffix++;
+	name = ccs_malloc(la + 3);
+	for (i = 0; i < 2; i++) {
+		int p = prefix;
+		int s = suffix;
+		//The differing part takes in the digits around it
+		while (p > 0 && classes[i]((unsigned char) a[p - 1]))
+			p--;
+		while (s > 0 && classes[i]((unsigned char) a[la - s]))
+			s--;
+		if (!ccs_all_chars(a + p, la - s - p, classes[i]) ||
+		    !ccs_all_chars(b + p, lb - s - p, classes[i]))
+			continue;
+		//Words made of a-f are not hex numbers
+		if (i && !ccs_has_digit(a + p, la - s - p) &&
+		    !ccs_has_digit(b + p, lb - s - p))
+			continue;
+		sprintf(name, "%.*s%s%s", p, a, wildcards[i], a + la - s);
+		return name;
+	}
+	//Anything else needs some fixed text around it
+	if (prefix + suffix < 2) {
+		free(name);
+		return NULL;
+	}
+	sprintf(name, "%.*s\\*%s", prefix, a, a + la - suffix);
+	return name;
+}
+
+//Pattern covering paths @a and @b, NULL if none is safe
+static char *ccs_generalize_pair(const char *a, const char *b)
+{
+	const char *sa[64];                   //'/' before each component
+	const char *sb[64];
+	int na = 0;
+	int nb = 0;
+	int lead;
+	int trail;
+	int len = 0;
+	int i;
+	char *pattern;
+	const char *cp;
+	for (cp = a; cp && na < 64; cp = strchr(cp, '/'))
+		sa[na++] = ++cp - 1;
+	for (cp = b; cp && nb < 64; cp = strchr(cp, '/'))
+		sb[nb++] = ++cp - 1;
+	if (na == 64 || nb == 64 || na < 2 || nb < 2)
+		return NULL;
+	pattern = ccs_malloc(strlen(a) + strlen(b) + 16);
+	if (na != nb)
+		goto dirs;
+	//Same depth, generalize the components that differ but never the top directory
+	for (i = 0; i < na; i++) {
+		const char *ea = i + 1 < na ? sa[i + 1] : a + strlen(a);
+		const char *eb = i + 1 < nb ? sb[i + 1] : b + strlen(b);
+		char *name = ccs_generalize_name(sa[i] + 1, ea - sa[i] - 1,
+						 sb[i] + 1, eb - sb[i] - 1);
+		if (!name || (!i && (ea - sa[i] != eb - sb[i] ||
+				     strncmp(sa[i], sb[i], ea - sa[i])))) {
+			free(name);
+			goto fail;
+		}
+		len += sprintf(pattern + len, "/%s", name);
+		free(name);
+	}
+	return pattern;
+dirs:
+	//Different depth, same start and end: /start/\{\*\}/end
+	for (lead = 0; lead < na && lead < nb; lead++) {
+		const char *ea = lead + 1 < na ? sa[lead + 1] : a + strlen(a);
+		if (ea - sa[lead] != (lead + 1 < nb ? sb[lead + 1] : b + strlen(b)) - sb[lead] ||
+		    strncmp(sa[lead], sb[lead], ea - sa[lead]))
+			break;
+	}
+	trail = 0;
+	while (trail < na - lead - 1 && trail < nb - lead - 1 &&
+	       !strcmp(sa[na - trail - 1], sb[nb - trail - 1]))
+		trail++;
+	if (!lead || !trail || lead + trail >= na || lead + trail >= nb)
+		goto fail;
+	sprintf(pattern, "%.*s/\\{\\*\\}%s", (int) (sa[lead] - a), a, sa[na - trail]);
+	return pattern;
+fail:
+	free(pattern);
+	return NULL;
+}
+
+//Learned lines covered by a pattern learned earlier
+static _Bool ccs_generalized_covers(const struct ccs_path_info *domain,
+				    const char *line)
+{
+	char *copy = ccs_strdup(line);
+	char *path;
+	char *tail;
+	_Bool found = false;
+	int i;
+	int j;
+	if (!ccs_generalize_min || !ccs_split_acl(copy, &path, &tail)) {
+		free(copy);
+		return false;
+	}
+	for (i = 0; i < ccs_learn_groups_len && !found; i++) {
+		const struct ccs_learn_group *ptr = &ccs_learn_groups[i];
+		struct ccs_path_info name;
+		if (ptr->domain != domain || strcmp(ptr->operation->name, copy) ||
+		    strcmp(ptr->tail->name, tail))
+			continue;
+		name.name = path;
+		ccs_fill_path_info(&name);
+		for (j = 0; j < ptr->patterns_len && !found; j++)
+			found = ccs_path_matches_pattern(&name, ptr->patterns[j]);
+	}
+	free(copy);
+	return found;
+}
+
+//Replace @group's paths covered by @pattern with one line
+static void ccs_generalize_commit(struct ccs_learn_group *group,
+				  const struct ccs_path_info *pattern)
+{
+	const int index = ccs_mirror_domain(group->domain);
+	const struct ccs_path_info *acl;
+	int covered = 0;
+	int i;
+	for (i = group->paths_len - 1; i >= 0; i--) {
+		if (!ccs_path_matches_pattern(group->paths[i], pattern))
+			continue;
+		acl = ccs_join_acl(group->operation->name, group->paths[i]->name,
+				   group->tail->name);
+		if (!ccs_learn_unqueue(group->domain, acl)) {
+			char *line = ccs_malloc(acl->total_len + 8);
+			sprintf(line, "delete %s", acl->name);
+			ccs_learn_queue_add(group->domain, ccs_savename(line));
+			free(line);
+		}
+		if (index != EOF)
+			ccs_del_string_entry(&ccs_domain_mirror, acl->name, index);
+		group->paths[i] = group->paths[--group->paths_len];
+		covered++;
+	}
+	group->patterns = ccs_realloc(group->patterns, (group->patterns_len + 1) *
+				      sizeof(const struct ccs_path_info *));
+	group->patterns[group->patterns_len++] = pattern;
+	acl = ccs_join_acl(group->operation->name, pattern->name, group->tail->name);
+	if (index != EOF)
+		ccs_add_string_entry(&ccs_domain_mirror, acl->name, index);
+	ccs_learn_queue_add(group->domain, acl);
+	ccs_printw(" Generalized                      = %s (%d lines)\n", acl->name, covered);
+}
+
+//Look for a pattern covering @acl and the lines learned before it
+static void ccs_generalize(const struct ccs_path_info *domain,
+			   const struct ccs_path_info *acl)
+{
+	struct ccs_learn_group *group;
+	const struct ccs_path_info *best = NULL;
+	int best_count = 0;
+	char *copy = ccs_strdup(acl->name);
+	char *path;
+	char *tail;
+	int i;
+	int j;
+	if (!ccs_split_acl(copy, &path, &tail)) {
+		free(copy);
+		return;
+	}
+	group = ccs_learn_group(domain, ccs_savename(copy), ccs_savename(tail));
+	group->paths = ccs_realloc(group->paths, (group->paths_len + 1) *
+				   sizeof(const struct ccs_path_info *));
+	group->paths[group->paths_len++] = ccs_savename(path);
+	free(copy);
+	if (group->paths_len < ccs_generalize_min)
+		return;
+	//Pair the new path with the most recent ones, keep what covers the most
+	for (i = group->paths_len - 2;
+	     i >= 0 && i >= group->paths_len - 1 - CCS_GENERALIZE_WINDOW; i--) {
+		char *candidate = ccs_generalize_pair(group->paths[group->paths_len - 1]->name,
+						      group->paths[i]->name);
+		const struct ccs_path_info *pattern;
+		int count = 0;
+		if (!candidate)
+			continue;
+		pattern = ccs_correct_path(candidate) ? ccs_savename(candidate) : NULL;
+		free(candidate);
+		if (!pattern || pattern == best)
+			continue;
+		for (j = 0; j < group->paths_len; j++)
+			count += ccs_path_matches_pattern(group->paths[j], pattern);
+		if (count > best_count) {
+			best = pattern;
+			best_count = count;
+		}
+	}
+	if (best && best_count >= ccs_generalize_min)
+		ccs_generalize_commit(group, best);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Utility functions - Learn sessions
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//Session learning @domain, NULL if none. Expired sessions are dropped on the way.
+static struct ccs_learn_session *ccs_learn_session_find(const struct ccs_path_info *domain)
+{
+	const time_t now = ccs_monotonic_now();
+	int i;
+	for (i = ccs_learn_sessions_len - 1; i >= 0; i--) {
+		if (ccs_learn_sessions[i].expires > now)
+			continue;
+		ccs_printw(" Learn Mode                       = Going Off - Timeout (%s)\n",
+			   ccs_learn_sessions[i].domain->name);
+		ccs_learn_sessions[i] = ccs_learn_sessions[--ccs_learn_sessions_len];
+	}
+	for (i = 0; i < ccs_learn_sessions_len; i++)
+		if (ccs_learn_sessions[i].domain == domain)
+			return &ccs_learn_sessions[i];
+	return NULL;
+}
+
+//Allow & Learn: learn the next requests of @domain for a while
+static void ccs_learn_session_start(const struct ccs_path_info *domain)
+{
+	struct ccs_learn_session *ptr;
+	if (ccs_learn_session_find(domain))
+		return;
+	ccs_learn_sessions = ccs_realloc(ccs_learn_sessions,
+					 (ccs_learn_sessions_len + 1) *
+					 sizeof(struct ccs_learn_session));
+	ptr = &ccs_learn_sessions[ccs_learn_sessions_len++];
+	ptr->domain = domain;
+	ptr->expires = ccs_monotonic_now() + ccs_learn_session_time;
+	ptr->budget = ccs_learn_session_lines;
+}
+
+//Use up one line of @domain's session, false if it is not being learned
+static _Bool ccs_learn_session_take(const struct ccs_path_info *domain)
+{
+	struct ccs_learn_session *ptr = ccs_learn_session_find(domain);
+	if (!ptr)
+		return false;
+	if (--ptr->budget <= 0) {
+		ccs_printw(" Learn Mode                       = Going Off - Line Budget (%s)\n",
+			   domain->name);
+		*ptr = ccs_learn_sessions[--ccs_learn_sessions_len];
+	}
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Utility functions - Repeat guard
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//Answers the kernel keeps rejecting usually mean this program is not registered
+static _Bool ccs_check_repeat(void)
+{
+    //Avoid too many repeat because the firewall is not registered             
+    if (how_many_auto_query_repeat > 25) {
+        char messagex[32768] = "";
+        fprintf(stderr, "\n\n\nError some thing went wrong more than 15 same request !\n\n\n"
+        "You need to register this program to %s to run this program.\n\n\n", CCS_PROC_POLICY_MANAGER);
+        //Popup Warning
+        popup_warning("Tomoyo : Error some thing went wrong more than 15 same request !","45");
+        strcat(messagex, "Tomoyo : You need to register this program to ");
+        strcat(messagex, CCS_PROC_POLICY_MANAGER);
+        strcat(messagex, " to run this program");
+        popup_warning(messagex,"45");
+        return false;
+    }
+    if ((how_many_auto_query_repeat > 150) && !ccs_quit_prompt_id) {
+        //Popup Warning Too Many Repeat
+        ccs_printw("\n\n\nWarning same request repeated more than 150x\n\n\n");
+        popup_warning("Tomoyo : Warning same request repeated more than 150x !","45");
+        char messagex[32768] = "";
+        strcat(messagex, "Tomoyo : It could be that you need to register this program to ");
+        strcat(messagex, CCS_PROC_POLICY_MANAGER);
+        strcat(messagex, " to run this program");
+        popup_warning(messagex,"45");
+        //Answered in ccs_prompt_answered(), Yes or timeout quits
+        ccs_quit_prompt_id = ccs_prompt(CCS_PROMPT_QUESTION, "Tomoyo : quit monitor to avoid infenite loop ? \nTimeout will quit", "45");
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Utility functions - Prompt helper
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// The helper is forked once at startup and gets dialogs over a SOCK_SEQPACKET
+// socketpair, one struct ccs_prompt_request per message. It runs zenity
+// directly (no shell, no wmctrl loop) for each of them and sends back one
+// struct ccs_prompt_reply per dialog once it is closed. Warnings and
+// notifications get no reply.
+//
+// Notifications are run as the desktop user with the session's DISPLAY and
+// D-Bus address. The session is found once, through the screen saver/locker
+// process like "ps auxw | grep -i screen" did, and looked up again only when
+// that process exits.
+//
+
+//Desktop session notifications go to
+struct ccs_desktop_session {
+	pid_t pid;            //Process the session was found through, 0 if none
+	time_t checked;       //Last lookup, to not rescan /proc for every notification when there is no session
+	uid_t uid;
+	gid_t gid;
+	char user[64];
+	char *env[8];         //NULL terminated
+};
+static struct ccs_desktop_session ccs_session;
+#define CCS_SESSION_RETRY 10
+
+//A dialog the helper is waiting on
+struct ccs_prompt_dialog {
+	unsigned int id;
+	int kind;
+	pid_t pid;
+	int fd;               //zenity's stdout/stderr
+	int len;
+	char output[1024];    //Start of what zenity printed, holds the button label
+};
+
+//Copy @name=value from @vars (NUL separated, @len bytes) into the session environment
+static void ccs_session_setenv(int *envc, const char *vars, int len,
+			       const char *name)
+{
+	const int name_len = strlen(name);
+	const char *cp = vars;
+	while (cp < vars + len && *envc < 7) {
+		if (!strncmp(cp, name, name_len) && cp[name_len] == '=') {
+			ccs_session.env[(*envc)++] = strdup(cp);
+			return;
+		}
+		cp += strlen(cp) + 1;
+	}
+}
+
+static int ccs_read_proc_file(pid_t pid, const char *file, char *buf, int size)
+{
+	char path[64];
+	int fd;
+	int len;
+	snprintf(path, sizeof(path), "/proc/%u/%s", pid, file);
+	fd = open(path, O_RDONLY);
+	if (fd == EOF)
+		return 0;
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len < 0)
+		len = 0;
+	buf[len] = '\0';
+	return len;
+}
+
+//Find the desktop session, a process whose command line contains "screen"
+static void ccs_find_session(void)
+{
+	static char buf[65536];
+	DIR *dir = opendir("/proc");
+	struct dirent *entry;
+	int i;
+	for (i = 0; ccs_session.env[i]; i++)
+		free(ccs_session.env[i]);
+	memset(&ccs_session, 0, sizeof(ccs_session));
+	ccs_session.checked = time(NULL);
+	while (dir && (entry = readdir(dir)) != NULL) {
+		const pid_t pid = atoi(entry->d_name);
+		const struct passwd *pw;
+		struct stat st;
+		char path[64];
+		int envc = 0;
+		int len;
+		if (pid <= 1 || pid == getpid())
+			continue;
+		len = ccs_read_proc_file(pid, "cmdline", buf, sizeof(buf));
+		for (i = 0; i < len; i++)
+			if (!buf[i])
+				buf[i] = ' ';
+		if (!strcasestr(buf, "screen"))
+			continue;
+		snprintf(path, sizeof(path), "/proc/%u", pid);
+		if (stat(path, &st))
+			continue;
+		pw = getpwuid(st.st_uid);
+		if (!pw)
+			continue;
+		ccs_session.pid = pid;
+		ccs_session.uid = pw->pw_uid;
+		ccs_session.gid = pw->pw_gid;
+		snprintf(ccs_session.user, sizeof(ccs_session.user), "%s", pw->pw_name);
+		len = ccs_read_proc_file(pid, "environ", buf, sizeof(buf));
+		ccs_session_setenv(&envc, buf, len, "DISPLAY");
+		ccs_session_setenv(&envc, buf, len, "WAYLAND_DISPLAY");
+		ccs_session_setenv(&envc, buf, len, "DBUS_SESSION_BUS_ADDRESS");
+		ccs_session_setenv(&envc, buf, len, "XDG_RUNTIME_DIR");
+		ccs_session_setenv(&envc, buf, len, "HOME");
+		ccs_session_setenv(&envc, buf, len, "PATH");
+		break;
+	}
+	if (dir)
+		closedir(dir);
+}
+
+//Cached session, looked up again once its process is gone
+static _Bool ccs_get_session(void)
+{
+	if (ccs_session.pid ? kill(ccs_session.pid, 0) && errno == ESRCH :
+	    time(NULL) - ccs_session.checked >= CCS_SESSION_RETRY)
+		ccs_find_session();
+	return ccs_session.pid != 0;
+}
+
+static void ccs_notify_exec(const struct ccs_prompt_request *req)
+{
+	const char *argv[] = { "notify-send", "-a", "Tomoyo", "-i",
+			       "cs-firewall", "Tomoyo", req->text, NULL };
+	if (getuid() != ccs_session.uid &&
+	    (initgroups(ccs_session.user, ccs_session.gid) ||
+	     setgid(ccs_session.gid) || setuid(ccs_session.uid)))
+		return;
+	execvpe("notify-send", (char **) argv, ccs_session.env);
+}
+
+static void ccs_prompt_exec(const struct ccs_prompt_request *req)
+{
+	char timeout[16];
+	char label[32];
+	const char *argv[32];
+	int argc = 0;
+	snprintf(timeout, sizeof(timeout), "%d", req->timeout);
+	argv[argc++] = "zenity";
+	argv[argc++] = "--timeout";
+	argv[argc++] = timeout;
+	argv[argc++] = "--no-markup";
+	if (req->kind == CCS_PROMPT_QUERY) {
+		snprintf(label, sizeof(label), "Deny (%ds)", req->timeout);
+		argv[argc++] = "--question";
+		argv[argc++] = "--width=675";
+		argv[argc++] = "--height=150";
+		argv[argc++] = "--ellipsize";
+		argv[argc++] = "--switch";
+		argv[argc++] = "--title=CCS-Tomoyo-Query";
+		argv[argc++] = "--extra-button=Allow & Learn";
+		argv[argc++] = "--extra-button=Allow All & Save";
+		argv[argc++] = "--extra-button=Allow";
+		argv[argc++] = "--extra-button";
+		argv[argc++] = label;
+		argv[argc++] = "--extra-button=Deny All";
+	} else if (req->kind == CCS_PROMPT_QUESTION) {
+		snprintf(label, sizeof(label), "No (%ds)", req->timeout);
+		argv[argc++] = "--question";
+		argv[argc++] = "--width=250";
+		argv[argc++] = "--height=50";
+		argv[argc++] = "--switch";
+		argv[argc++] = "--title=CCS-Tomoyo-Query";
+		argv[argc++] = "--extra-button";
+		argv[argc++] = label;
+		argv[argc++] = "--extra-button=Yes";
+	} else {
+		snprintf(label, sizeof(label), "Ok (%ds)", req->timeout);
+		argv[argc++] = "--warning";
+		argv[argc++] = "--width=250";
+		argv[argc++] = "--height=50";
+		argv[argc++] = "--ok-label";
+		argv[argc++] = label;
+		argv[argc++] = "--title=CCS-Tomoyo-Query-Warning";
+	}
+	argv[argc++] = "--text";
+	argv[argc++] = req->text;
+	argv[argc] = NULL;
+	execvp("zenity", (char **) argv);
+}
+
+//Turn the clicked button and zenity's exit status into the old result codes
+static int ccs_prompt_result(const struct ccs_prompt_dialog *dialog, int status)
+{
+	const int level = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+	const char *ans = dialog->output;
+	if (dialog->kind == CCS_PROMPT_QUERY) {
+		if (strstr(ans, "Allow & Learn"))    return 25600;
+		if (strstr(ans, "Allow All & Save")) return 51200;
+		if (strstr(ans, "Allow All"))        return 11264;
+		if (strstr(ans, "Allow"))            return 36864;
+		if (strstr(ans, "Deny All"))         return 62464;
+		if (strstr(ans, "Deny ("))           return 22528;
+	} else if (dialog->kind == CCS_PROMPT_QUESTION) {
+		if (strstr(ans, "Yes"))              return 25600;
+		if (strstr(ans, "No ("))             return 51200;
+	}
+	if (level == 0 || level == 1)            return 59392; //zenity worked, no button captured
+	if (level == 5)                          return 53248; //Timeout
+	return 47104;                                          //zenity did not run
+}
+
+static _Bool ccs_prompt_open(struct ccs_prompt_dialog *dialog,
+			     const struct ccs_prompt_request *req)
+{
+	int pipe_fd[2];
+	if (pipe2(pipe_fd, O_CLOEXEC))
+		return false;
+	dialog->pid = fork();
+	if (dialog->pid == 0) {
+		dup2(pipe_fd[1], 1);
+		dup2(pipe_fd[1], 2);
+		if (req->kind == CCS_PROMPT_NOTIFY)
+			ccs_notify_exec(req);
+		else
+			ccs_prompt_exec(req);
+		_exit(127);
+	}
+	close(pipe_fd[1]);
+	if (dialog->pid == -1) {
+		close(pipe_fd[0]);
+		return false;
+	}
+	dialog->id = req->id;
+	dialog->kind = req->kind;
+	dialog->fd = pipe_fd[0];
+	dialog->len = 0;
+	dialog->output[0] = '\0';
+	return true;
+}
+
+static _Bool ccs_prompt_wants_reply(int kind)
+{
+	return kind == CCS_PROMPT_QUERY || kind == CCS_PROMPT_QUESTION;
+}
+
+//Body of the helper process, returns when ccs-firewall went away and the
+//warnings it left were dismissed
+static void ccs_prompt_helper(int fd)
+{
+	static struct ccs_prompt_request req;
+	struct ccs_prompt_dialog *dialogs = NULL;
+	struct pollfd *pfd = NULL;
+	_Bool orphaned = false;
+	int dialogs_len = 0;
+	int i;
+	while (!orphaned || dialogs_len) {
+		pfd = ccs_realloc(pfd, (dialogs_len + 1) * sizeof(struct pollfd));
+		pfd[0].fd = orphaned ? EOF : fd;
+		pfd[0].events = POLLIN;
+		for (i = 0; i < dialogs_len; i++) {
+			pfd[i + 1].fd = dialogs[i].fd;
+			pfd[i + 1].events = POLLIN;
+		}
+		if (poll(pfd, dialogs_len + 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		//Walk backwards, closed dialogs are replaced by the last one
+		for (i = dialogs_len - 1; i >= 0; i--) {
+			struct ccs_prompt_dialog *dialog = &dialogs[i];
+			struct ccs_prompt_reply reply;
+			char buf[1024];
+			int status = 0;
+			int len;
+			if (!pfd[i + 1].revents)
+				continue;
+			len = read(dialog->fd, buf, sizeof(buf));
+			if (len > 0) {
+				if (len > sizeof(dialog->output) - 1 - dialog->len)
+					len = sizeof(dialog->output) - 1 - dialog->len;
+				memcpy(dialog->output + dialog->len, buf, len);
+				dialog->len += len;
+				dialog->output[dialog->len] = '\0';
+				continue;
+			}
+			close(dialog->fd);
+			waitpid(dialog->pid, &status, 0);
+			if (!orphaned && ccs_prompt_wants_reply(dialog->kind)) {
+				reply.id = dialog->id;
+				reply.result = ccs_prompt_result(dialog, status);
+				send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+			}
+			*dialog = dialogs[--dialogs_len];
+		}
+		if (pfd[0].revents) {
+			const int len = recv(fd, &req, sizeof(req), 0);
+			if (len <= (int) offsetof(struct ccs_prompt_request, text)) {
+				//Nobody is left to read the answers, but warnings
+				//such as why ccs-firewall quit stay up until dismissed
+				orphaned = true;
+				for (i = dialogs_len - 1; i >= 0; i--) {
+					if (!ccs_prompt_wants_reply(dialogs[i].kind))
+						continue;
+					kill(dialogs[i].pid, SIGTERM);
+					close(dialogs[i].fd);
+					waitpid(dialogs[i].pid, NULL, 0);
+					dialogs[i] = dialogs[--dialogs_len];
+				}
+				continue;
+			}
+			req.text[sizeof(req.text) - 1] = '\0';
+			if (req.kind == CCS_PROMPT_NOTIFY && !ccs_get_session())
+				continue;
+			dialogs = ccs_realloc(dialogs, (dialogs_len + 1) *
+					      sizeof(struct ccs_prompt_dialog));
+			if (ccs_prompt_open(&dialogs[dialogs_len], &req)) {
+				dialogs_len++;
+			} else if (ccs_prompt_wants_reply(req.kind)) {
+				struct ccs_prompt_reply reply = { req.id, 47104 };
+				send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+			}
+		}
+	}
+	for (i = 0; i < dialogs_len; i++)
+		kill(dialogs[i].pid, SIGTERM);
+}
+
+//The helper is a fresh exec of ccs-firewall in --prompt-helper= mode, a restart
+//forks while the saver and journal threads may hold locks in the C library
+static _Bool ccs_start_prompt_helper(void)
+{
+	char arg[32];
+	char *argv[] = { "ccs-firewall", arg, NULL };
+	int fds[2];
+	pid_t pid;
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds))
+		return false;
+	snprintf(arg, sizeof(arg), "--prompt-helper=%d", fds[1]);
+	pid = fork();
+	if (pid == 0) {
+		//Only async-signal-safe calls until exec
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+		//Set when restarted, don't keep the kernel interfaces open
+		if (ccs_query_fd != EOF)
+			close(ccs_query_fd);
+		if (ccs_domain_policy_fd != EOF)
+			close(ccs_domain_policy_fd);
+		if (!fcntl(fds[1], F_SETFD, 0))
+			execv("/proc/self/exe", argv);
+		_exit(127);
+	}
+	close(fds[1]);
+	if (pid == -1) {
+		close(fds[0]);
+		return false;
+	}
+	ccs_prompt_fd = fds[0];
+	return true;
+}
+
+//Ask the helper for a dialog, returns the id its answer will carry or 0
+static unsigned int ccs_prompt(int kind, const char *text, const char *timeout)
+{
+	static struct ccs_prompt_request req;
+	int len = strlen(text);
+	if (ccs_replay_fp)
+		return ccs_replay_prompt(kind);
+	if (ccs_prompt_fd == EOF)
+		return 0;
+	if (len > sizeof(req.text) - 1)
+		len = sizeof(req.text) - 1;
+	if (!++ccs_prompt_id)
+		ccs_prompt_id++;
+	req.id = ccs_prompt_id;
+	req.kind = kind;
+	req.timeout = atoi(timeout);
+	memcpy(req.text, text, len);
+	req.text[len] = '\0';
+	if (send(ccs_prompt_fd, &req, offsetof(struct ccs_prompt_request, text) +
+		 len + 1, MSG_NOSIGNAL) == -1)
+		return 0;
+	return req.id;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Utility functions - Pending queries
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//Wake up at the earliest provisional deadline
+static void ccs_arm_provisional(void)
+{
+	unsigned long long first = 0;
+	long long msec;
+	int i;
+	if (!ccs_provisional_deadline)
+		return;
+	for (i = 0; i < ccs_pending_list_len; i++) {
+		const struct ccs_pending_query *ptr = &ccs_pending_list[i];
+		if (!ptr->query.provisional && (!first || ptr->prompted_us < first))
+			first = ptr->prompted_us;
+	}
+	if (!first) {
+		ccs_arm_timer(ccs_provisional_fd, 0, false);
+		return;
+	}
+	msec = (long long) (first + ccs_provisional_deadline * 1000000ULL -
+			    ccs_usec_now()) / 1000;
+	ccs_arm_timer(ccs_provisional_fd, msec > 0 ? msec : 1, false);
+}
+
+static void ccs_add_pending(const struct ccs_query_info *q, unsigned int prompt_id)
+{
+	struct ccs_pending_query *ptr;
+	ccs_pending_list = ccs_realloc(ccs_pending_list,
+				       (ccs_pending_list_len + 1) *
+				       sizeof(struct ccs_pending_query));
+	ptr = &ccs_pending_list[ccs_pending_list_len++];
+	ccs_copy_query(&ptr->query, q);
+	ptr->prompt_id = prompt_id;
+	ptr->prompted_us = ccs_usec_now();
+	ccs_update_keepalive();
+	ccs_arm_provisional();
+}
+
+//Open prompt already asking about the same domain and ACL line, if any
+static struct ccs_pending_query *ccs_find_prompt(const struct ccs_query_info *q)
+{
+	int i;
+	for (i = 0; i < ccs_pending_list_len; i++) {
+		struct ccs_pending_query *ptr = &ccs_pending_list[i];
+		if (ptr->prompt_id && ptr->query.is_domain_query &&
+		    ptr->query.domain == q->domain &&
+		    !strcmp(ptr->query.acl, q->acl))
+			return ptr;
+	}
+	return NULL;
+}
+
+static struct ccs_pending_query *ccs_find_pending(unsigned int serial)
+{
+	int i;
+	for (i = 0; i < ccs_pending_list_len; i++)
+		if (ccs_pending_list[i].query.serial == serial)
+			return &ccs_pending_list[i];
+	return NULL;
+}
+
+static void ccs_write_answer(const struct ccs_query_info *q, int c,
+			     int source, int result)
+{
+	char answer[64];
+	unsigned long long now;
+	if (c == 'Y' || c == 'y' || c == 'A' || c == 'a')
+		c = 1;
+	else if (c == 'R' || c == 'r')
+		c = 3;
+	else
+		c = 2;
+	snprintf(answer, sizeof(answer) - 1, "A%u=%u\n", q->serial, c);
+	now = ccs_usec_now();
+	if (!q->provisional) {
+		//Counted for ccs_check_repeat(), cached answers repeating is fine
+		if (write(ccs_query_fd, answer, strlen(answer)) == strlen(answer))
+			how_many_auto_query_repeat = 0;
+		else
+			how_many_auto_query_repeat++;
+		ccs_stage_done(CCS_STAGE_ANSWER, now);
+		now = ccs_usec_now();
+		ccs_answered_serials[ccs_answered_pos++ % CCS_ANSWERED_HISTORY] = q->serial;
+	}
+	ccs_hist_add(&ccs_source_hist[source], now - q->received_us);
+	ccs_journal_decision(q, c, source, result, now - q->received_us);
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Utility functions - Insert policy 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-static void change_profile_policy(const char *ccs_buffer,const char *profileNum, const char *doSave)
+static _Bool ccs_query_known(unsigned int serial)
 {
-    int xxresult = 0;
+	int i;
+	if (ccs_find_pending(serial))
+		return true;
+	for (i = 0; i < CCS_ANSWERED_HISTORY && i < ccs_answered_pos; i++)
+		if (ccs_answered_serials[i] == serial)
+			return true;
+	return false;
+}
 
-    const char* domainString = extract_domain(ccs_buffer, "true");
+//Give queries that were attached to a prompt the same answer
+static void ccs_answer_coalesced(const struct ccs_query_info *leader, int c,
+				 int status)
+{
+	int i;
+	for (i = ccs_pending_list_len - 1; i >= 0; i--) {
+		struct ccs_pending_query *ptr = &ccs_pending_list[i];
+		if (ptr->prompt_id || ptr->query.domain != leader->domain ||
+		    strcmp(ptr->query.acl, leader->acl))
+			continue;
+		ccs_printw(" Coalesced Answer Q%u             = %c\n", ptr->query.serial, c);
+		ccs_write_answer(&ptr->query, c, ccs_journal_source(status, true), status);
+		free((void *) ptr->query.text);
+		*ptr = ccs_pending_list[--ccs_pending_list_len];
+	}
+	ccs_update_keepalive();
+}
 
-    char domainStringCommand[32768] = "";
-    strcat(domainStringCommand, "ccs-setprofile ");
-    strcat(domainStringCommand, profileNum);
-    strcat(domainStringCommand, " '");
-    strcat(domainStringCommand, domainString);
-    strcat(domainStringCommand, "' >/dev/null 2>&1");
+//Answer the queries waiting on a dialog (in whatever order they are closed)
+static _Bool ccs_prompt_answered(unsigned int prompt_id, int status)
+{
+	struct ccs_pending_query entry;
+	int i;
+	if (prompt_id == ccs_quit_prompt_id) {
+		ccs_quit_prompt_id = 0;
+		return (status != 25600) && (status != 53248); //Yes or timeout
+	}
+	for (i = 0; i < ccs_pending_list_len; i++)
+		if (ccs_pending_list[i].prompt_id == prompt_id)
+			break;
+	if (i == ccs_pending_list_len)
+		return true;
+	entry = ccs_pending_list[i];
+	ccs_pending_list[i] = ccs_pending_list[--ccs_pending_list_len];
+	ccs_stage_done(CCS_STAGE_WAIT, entry.prompted_us);
+	ccs_update_keepalive();
+	ccs_printw("\n Answered Query                   = Q%u\n", entry.query.serial);
+	if (entry.query.is_domain_query) {
+		int c;
+		if (!ccs_finish_query(&entry.query, status, true, &c)) {
+			free((void *) entry.query.text);
+			return false;
+		}
+		ccs_answer_coalesced(&entry.query, c, status);
+	} else {
+		const int c = (status == 25600) ? 'Y' : 'N'; //Yes
+		ccs_printw("%c\n", c);
+		ccs_write_answer(&entry.query, c, ccs_journal_source(status, true), status);
+	}
+	free((void *) entry.query.text);
+	return true;
+}
 
-    ccs_printw("\n");
-    ccs_printw(" Editing Profile Policy :\n");
-    ccs_printw(" %s\n", domainStringCommand);
-    ccs_printw("\n");
-    
-    //ccs-setprofile profileNum
-    xxresult=system(domainStringCommand);
-    if (xxresult != 0) {
-        popup_warning("Tomoyo Allow-All : Failed to save policy !","45");
-    }
+//Answer the kernel for queries waiting longer than --provisional, their prompts stay open
+static void ccs_provisional_expire(void)
+{
+	const unsigned long long now = ccs_usec_now();
+	int i;
+	for (i = ccs_pending_list_len - 1; i >= 0; i--) {
+		struct ccs_pending_query *ptr = &ccs_pending_list[i];
+		int c;
+		if (ptr->query.provisional ||
+		    now - ptr->prompted_us < ccs_provisional_deadline * 1000000ULL)
+			continue;
+		//A retried query comes back and joins the prompt again
+		c = (ptr->query.retry < ccs_provisional_retries) ? 'R' : 'N';
+		ccs_printw(" Provisional Answer Q%u           = %c\n", ptr->query.serial, c);
+		ccs_write_answer(&ptr->query, c, CCS_JOURNAL_PROVISIONAL, 0);
+		if (ptr->prompt_id) {
+			ptr->query.provisional = true;
+		} else {
+			free((void *) ptr->query.text);
+			*ptr = ccs_pending_list[--ccs_pending_list_len];
+		}
+	}
+	ccs_update_keepalive();
+	ccs_arm_provisional();
+}
 
-    //Result
-    ccs_printw("\n");
-    ccs_printw(" Edit Profile Policy :\n");
-    ccs_printw(" Ok                           = 0\n");
-    ccs_printw(" Nok                          = !0\n");
-    ccs_printw(" ------------------------------------\n");
-    ccs_printw(" Result                       = %d\n",xxresult);
-    ccs_printw("\n");
-    
-    //Save policy
-    if (strcmp(doSave, "true") == 0) {
-        save_policy();
-    } //else {
-        //save_policy_question();
-    //}
+//Collect exited notifications and prompt helpers
+static void ccs_reap_children(void)
+{
+	while (waitpid(-1, NULL, WNOHANG) > 0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Secondary Main Function
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-static _Bool ccs_handle_query(unsigned int serial)
+static _Bool ccs_handle_query(const struct ccs_query_info *q)
 {
     
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     // Setups & vars & print request 
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     
-    //Vars tomoyo
-	int y;
-	int x; //old code - not used but needed 
-    //int ret_ignored; //old code
-    unsigned int pid;
-    
     //Vars
-    int c = 'N';
-    char *line = NULL;
-	char pidbuf[128] = "";
 	static unsigned int prev_pid = 0;
-	char *cp = strstr(ccs_buffer, " (global-pid=");
-    
-	if (!cp || sscanf(cp + 13, "%u", &pid) != 1) {
-		ccs_printw("\n\nERROR: Unsupported query.\n\n");
-		return false;
-	}
     
-	cp = ccs_buffer + strlen(ccs_buffer);
-	if (*(cp - 1) != '\n') {
-		ccs_printw("\n\nERROR: Unsupported query.\n\n");
-		return false;
+    //Answer from the local rules or the decision cache without building a prompt
+	if (q->is_domain_query) {
+		const unsigned long long start = ccs_usec_now();
+		const struct ccs_decision *ptr;
+		const int answer = ccs_match_rules(q->domain, q->acl);
+		if (answer) {
+			ccs_stage_done(CCS_STAGE_LOOKUP, start);
+			ccs_printw(" Rule Answer Q%u                  = %c\n", q->serial, answer);
+			ccs_write_answer(q, answer, CCS_JOURNAL_RULE, 0);
+			return true;
+		}
+		//A line learned for it may still be queued
+		if (ccs_mirror_has(q->domain, ccs_savename(q->acl)) ||
+		    ccs_generalized_covers(q->domain, q->acl)) {
+			ccs_stage_done(CCS_STAGE_LOOKUP, start);
+			ccs_printw(" Policy Answer Q%u                = Y\n", q->serial);
+			ccs_write_answer(q, 'Y', CCS_JOURNAL_POLICY, 0);
+			return true;
+		}
+		ptr = ccs_decision_lookup(q->domain, q->acl);
+		ccs_stage_done(CCS_STAGE_LOOKUP, start);
+		if (ptr) {
+			ccs_printw(" Cached Answer Q%u                = %c\n", q->serial, ptr->answer);
+			ccs_write_answer(q, ptr->answer, CCS_JOURNAL_CACHE, 0);
+			return true;
+		}
 	}
     
-	*(cp - 1) = '\0';
-	if (pid != prev_pid) {
+	if (q->global_pid != prev_pid) {
 		if (prev_pid) ccs_printw("\n------------------------------------------------------------------------\n");
-		prev_pid = pid;
+		prev_pid = q->global_pid;
 	}
     
     //Print request
-	ccs_printw("%s\n", ccs_buffer);
+	ccs_printw("%s\n", q->text);
     
     /* Is this domain query? */
-	if (strstr(ccs_buffer, "\n#"))
+	if (!q->is_domain_query)
 		goto not_domain_query;
-	memset(pidbuf, 0, sizeof(pidbuf));    
-	snprintf(pidbuf, sizeof(pidbuf) - 1, "select Q=%u\n", serial);
 	ccs_printw("Allow? ('Y'es/'N'o/'R'etry/'S'how policy/'A'dd to policy and retry):");
     ccs_printw("\n");
         
@@ -522,189 +2693,88 @@ static _Bool ccs_handle_query(unsigned int serial)
     //Prepare Gui
     int xresult = 2;
     
-    //Remove date and time from request varialbe 
-    const char* substringcurrent = ccs_buffer + 22;
-    const char* substring1 = ccs_buffer_previous1 + 22;
-    const char* substring2 = ccs_buffer_previous2 + 22;
-    const char* substring3 = ccs_buffer_previous3 + 22;
-    
     //Start Debug Output
     ccs_printw("\n");
     //ccs_printw(" ----------------------------------------\n");
     //ccs_printw(" Debug Infos : --------------------------\n");
     ccs_printw(" ----------------------------------------\n");
     
-    //Checking if we are in learning mode I/II
-    if (allownLearn) {
-        //Reset allownLearn after 2 min
-        struct timeval current_time;
-        double elapsed_time_secs = 0;
-        gettimeofday(&current_time, NULL);
-        elapsed_time_secs = current_time.tv_sec - start_time_allowance.tv_sec;            
-        ccs_printw(" Learn Mode Elapsed               = %ds\n", (int) elapsed_time_secs);
-        if (elapsed_time_secs > 120) { //2 Mins
-            allownLearn = false;
-            ccs_printw(" Learn Mode                       = Going Off - Timeout\n");
-        }
-    }    
-    
-    //Checking if we are in learning mode II/II
-    if (allownLearn) {
-        char domainStringHistory0[32768] = ""; //Current request 
-        char domainStringHistory1[32768] = ""; //Last request
-        
-        strcat(domainStringHistory0, extract_domain(ccs_buffer, "false"));
-        strcat(domainStringHistory1, extract_domain(substring1, "false"));
-        
-        if (strcmp(domainStringHistory0, domainStringHistory1) == 0) {
-            xresult = 36864;
-            ccs_printw(" Learn Mode                       = On\n");
-        } else {
-            allownLearn = false;
-            ccs_printw(" Learn Mode                       = Going Off - Other App Req.\n");
-        }
+    //Checking if the domain is being learned, every domain has its own session
+    if (ccs_learn_session_find(q->domain)) {
+        xresult = 36864;
+        ccs_printw(" Learn Mode                       = On\n");
     } else {
         //Stdr State
         ccs_printw(" Learn Mode                       = Off\n");
     }
     
-    //Getting request profile 
-    const char* tmpprofile = ccs_buffer + 30;
-    char requestprofile = '0';
-    requestprofile=tmpprofile[0];
-    
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     // Delegate answer to gui = generate zenity question only if domain profile is 0 or 1 
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     
     if (xresult == 2) {
         // ............................ Only ask if profile is 0 or 1
-        if ((requestprofile == '0') || (requestprofile == '1')) {
-            if ((strcmp(substring1, substringcurrent) != 0) || (firstrun)) { // .... To avoid repetition - check 3 past time 
-                if ((strcmp(substring2, substringcurrent) != 0) || (firstrun)) {
-                    if ((strcmp(substring3, substringcurrent) != 0) || (firstrun)) { 
-                        //Main Question ---------------------------------------------------------------
-                        //Init question
-                        const char* message = message_question;
-                        prepare_main_question(ccs_buffer, "45");
-                                                
-                        //Send Question: --------------------------------------------------------------
-                        //fork fix ccs_send_keepalive that was leading to policy not saved 
-                        //(when 'A' add policy) and also fix several window for same request issue 
-                        //-----------------------------------------------------------------------------
-                        
-                        
-                        //Use fork for notification to avoid waiting it...
-                        pid_t child_pid_notification = -1;
-                        child_pid_notification = fork();
-                        
-                        if (child_pid_notification == 0) {
-                            //Child code
-                            //Send Notification
-                            ccs_send_keepalive();
-                            send_notification(ccs_buffer);
-                        } else {
-                            int wait_loop=5; //Give notification 2.5 sec to react (this is a non blocking code...)
-                            while (wait_loop != 0) {ccs_send_keepalive(); usleep(500); wait_loop--;}
-                            kill(child_pid_notification, SIGKILL);
-                            wait(NULL); //properly terminate child and hande child exit, avoid zombie process (called from child)
-                        }
-                        
-                        //Parent code
-                        pid_t child_pid = -1;
-                        child_pid = fork();
-
-                        if (child_pid == 0)
-                            //Child code
-                            {while (true) {ccs_send_keepalive(); usleep(500);}}
-                        else { 
-                            //Parent code
-                            xresult = system(message);                            
-                            kill(child_pid, SIGKILL); //SIGTERM = Graceful termination
-                            wait(NULL); //properly terminate child and hande child exit, avoid zombie process (called from child)
-                        }
-                        
-                        //-----------------------------------------------------------------------------
-                        
-                        //Keep Alive
-                        ccs_send_keepalive();
-                        
-                        //First Run -------------------------------------------------------------------
-                        if (firstrun) {
-                            //copy past 0 result to 1
-                            strcpy(ccs_buffer_previous1,ccs_buffer);
-                            ccs_buffer_previous_answer1 = xresult;
-                            //Init buffer 2 & 3 
-                            strcpy(ccs_buffer_previous2,"------------------------B2 \n Int2----------\n-- Empty Buffer 2"); //Long to avoid empty with 
-                            strcpy(ccs_buffer_previous3,"------------------------B3 \n Int3----------\n-- Empty Buffer 3"); //date supression done before
-                            ccs_buffer_previous_answer2 = xresult;
-                            ccs_buffer_previous_answer3 = xresult;
-                            //Disable first run
-                            firstrun=false;
-                        } else {
-                            //copy past 2 result to 3
-                            strcpy(ccs_buffer_previous3,ccs_buffer_previous2);
-                            ccs_buffer_previous_answer3 = ccs_buffer_previous_answer2;
-                            //copy past 1 result to 2
-                            strcpy(ccs_buffer_previous2,ccs_buffer_previous1);
-                            ccs_buffer_previous_answer2 = ccs_buffer_previous_answer1;
-                            //copy past 0 result to 1
-                            strcpy(ccs_buffer_previous1,ccs_buffer);
-                            ccs_buffer_previous_answer1 = xresult;
-                        }
-                        //Repeat Init -----------------------------------------------------------------
-                        how_many_auto_query_repeat = 0;
-                        //Main Question ---------------------------------------------------------------
-                    } else {
-                        xresult = ccs_buffer_previous_answer3;
-                        how_many_auto_query_repeat++;
-                    }
-                } else {
-                    xresult = ccs_buffer_previous_answer2;
-                    how_many_auto_query_repeat++;
-                }
-            } else {
-                xresult = ccs_buffer_previous_answer1;
-                how_many_auto_query_repeat++;
-            }
-
-            //Avoid too many repeat because the firewall is not registered             
-            if ((how_many_auto_query_repeat > 25) && ((xresult != 62464) && (xresult != 22528))) {
-                char messagex[32768] = "";
-                fprintf(stderr, "\n\n\nError some thing went wrong more than 15 same request !\n\n\n"
-                "You need to register this program to %s to run this program.\n\n\n", CCS_PROC_POLICY_MANAGER);
-                //Popup Warning
-                popup_warning("Tomoyo : Error some thing went wrong more than 15 same request !","45");
-                strcat(messagex, "Tomoyo : You need to register this program to ");
-                strcat(messagex, CCS_PROC_POLICY_MANAGER);
-                strcat(messagex, " to run this program");
-                popup_warning(messagex,"45");
-                return false;
+        if (q->profile <= 1) {
+            //Same request from another process while its prompt is open, wait for that answer
+            if (ccs_find_prompt(q)) {
+                ccs_printw(" Coalesced Query                  = Q%u\n", q->serial);
+                ccs_add_pending(q, 0);
+                return true;
             }
-            if (how_many_auto_query_repeat > 150) {
-                //Popup Warning Too Many Repeat
-                ccs_printw("\n\n\nWarning same request repeated more than 150x\n\n\n");
-                popup_warning("Tomoyo : Warning same request repeated more than 150x !","45");
-                char messagex[32768] = "";
-                strcat(messagex, "Tomoyo : It could be that you need to register this program to ");
-                strcat(messagex, CCS_PROC_POLICY_MANAGER);
-                strcat(messagex, " to run this program");
-                popup_warning(messagex,"45");
-                int question_error = popup_question("Tomoyo : quit monitor to avoid infenite loop ? \nTimeout will quit", "45");
-                if ((question_error == 25600) || (question_error == 53248)) {
-                    return false;
-                }
+            
+            //Main Question ---------------------------------------------------------------
+            const unsigned long long prompt_start = ccs_usec_now();
+            //Init question
+            prepare_main_question(q->text);
+                                    
+            //Notification is not waited for, SIGCHLD collects it
+            send_notification(q->text);
+            
+            //The prompt helper opens the dialog, the answer is written when it is closed
+            const unsigned int prompt_id = ccs_prompt(CCS_PROMPT_QUERY, message_question, "45");
+            ccs_stage_done(CCS_STAGE_PROMPT, prompt_start);
+            if (prompt_id) {
+                ccs_add_pending(q, prompt_id);
+                return true;
             }
+            xresult = 47104;
         } else {
             xresult=256;
         }
     }
     
-    //-------------------------------------------------
-    //old code
-    //xresult = system(message);
-    //ccs_send_keepalive();    
-    //-------------------------------------------------
+    return ccs_finish_query(q, xresult, false, NULL);
+    
+not_domain_query:
+	ccs_printw("Allow? ('Y'es/'N'o/'R'etry):");
+    
+    ccs_send_keepalive();
+    const unsigned long long question_start = ccs_usec_now();
+    const unsigned int question_id = ccs_prompt(CCS_PROMPT_QUESTION, "Tomoyo : Non domain query request...\nAllow ?", "45");
+    ccs_stage_done(CCS_STAGE_PROMPT, question_start);
+    if (question_id) {
+        ccs_add_pending(q, question_id);
+        return true;
+    }
+    ccs_printw("N\n");
+    ccs_write_answer(q, 'N', CCS_JOURNAL_FAILURE, 47104);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Secondary Main Function - Apply answer
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static _Bool ccs_finish_query(const struct ccs_query_info *q, int xresult,
+			      _Bool from_prompt, int *answer)
+{
+    //Vars tomoyo
+	int y;
+	int x; //old code - not used but needed 
+    
+    //Vars
+    int c = 'N';
+    char *line = NULL;
     
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     // Gui set result & result code 
@@ -776,6 +2846,9 @@ static _Bool ccs_handle_query(unsigned int serial)
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     
     if (c == 'L') {
+        //Nothing was decided, don't cache it
+        from_prompt = false;
+        
         //stderr Warning
         fprintf(stderr, "\n\n\nTomoyo : Warning 59392 : Aswer was not captured may be\n"
         "because window was closed, this application need, this\n"
@@ -796,6 +2869,9 @@ static _Bool ccs_handle_query(unsigned int serial)
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     
     if (c == 'M') {
+        //Nothing was decided, don't cache it
+        from_prompt = false;
+        
         //stderr Warning
         fprintf(stderr, "\n\n\nTomoyo : Warning 47104 : Unable to run zenity,\n"
         "this application need zenity v3.24 minimum,\n"
@@ -817,7 +2893,7 @@ static _Bool ccs_handle_query(unsigned int serial)
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     
     if (c == 'X') {
-        change_profile_policy(ccs_buffer , "2" , "false");
+        change_profile_policy(q->domain , 2 , "false");
         
         //Set true answer
         c = 'Y';
@@ -831,7 +2907,7 @@ static _Bool ccs_handle_query(unsigned int serial)
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     
     if (c == 'Z') {
-        change_profile_policy(ccs_buffer , "8" , "false");
+        change_profile_policy(q->domain , 8 , "false");
         
         //Set true answer
         c = 'N';
@@ -845,12 +2921,8 @@ static _Bool ccs_handle_query(unsigned int serial)
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     
     if (c == 'J') {
-        if (!allownLearn) {
-            //Start timer
-            gettimeofday(&start_time_allowance, NULL);
-            //Enable learn for next request
-            allownLearn = true;
-        }
+        //Enable learn for next requests of this domain
+        ccs_learn_session_start(q->domain);
         
         //Answer set to allow
         c = 'A';
@@ -864,7 +2936,7 @@ static _Bool ccs_handle_query(unsigned int serial)
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     
     if (c == 'K') {
-        change_profile_policy(ccs_buffer , "2" , "true");
+        change_profile_policy(q->domain , 2 , "true");
         
         //Set true answer
         c = 'Y';
@@ -879,39 +2951,7 @@ static _Bool ccs_handle_query(unsigned int serial)
     
     // Function to list policy 
 	if (c == 'S' || c == 's') {
-		if (ccs_network_mode) {
-			fprintf(ccs_domain_fp, "%s", pidbuf);
-			fputc(0, ccs_domain_fp);
-			fflush(ccs_domain_fp);
-			rewind(ccs_domain_fp);
-			while (1) {
-				char c;
-				if (fread(&c, 1, 1, ccs_domain_fp) != 1 || !c)
-					break;
-				addch(c);
-				refresh();
-				ccs_send_keepalive();
-			}
-		} 
-        else {
-            //old code version
-			//ret_ignored = write(ccs_domain_policy_fd, pidbuf, strlen(pidbuf));
-			write(ccs_domain_policy_fd, pidbuf, strlen(pidbuf));
-			while (1) {
-				int i;
-				int len = read(ccs_domain_policy_fd,
-					       ccs_buffer,
-					       sizeof(ccs_buffer) - 1);
-				if (len <= 0)
-					break;
-				for (i = 0; i < len; i++) {
-					addch(ccs_buffer[i]);
-					refresh();
-				}
-				ccs_send_keepalive();
-			}
-            
-		}
+		ccs_mirror_show(q->domain);
 		c = 'r';
 	}
     
@@ -920,7 +2960,7 @@ static _Bool ccs_handle_query(unsigned int serial)
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     
     //Convert yes to append on learning mode
-    if (allownLearn && c == 'Y') {
+    if (c == 'Y' && ccs_learn_session_take(q->domain)) {
         c = 'A';
     }
     
@@ -928,33 +2968,38 @@ static _Bool ccs_handle_query(unsigned int serial)
 	if (c != 'A' && c != 'a')
 		goto not_append;
     
-    //Answer set to r
+    //Answer set to r, allowed once a line is queued
 	c = 'r';
     
+    //Nobody to edit the line without a terminal, learn it as asked
+	if (ccs_headless) {
+		if (!q->acl)
+			return false;
+		line = strdup(q->acl);
+		goto learn_line;
+	}
+    
     //The getyx macro places the current cursor position of the given window in the two integer variables y and x.
     //The default window. A default window called stdscr, which is the size of the terminal screen, 
     //is supplied. To use the stdscr window, you don't need to do any initializations. 
     //You can also divide the screen to several parts and create a window to represent each part.
+	ccs_repaint();
 	getyx(stdscr, y, x);
     
-    //Locate last occurrence of character in string (strrchr)
-	cp = strrchr(ccs_buffer, '\n');
-    
-	if (!cp)
+    //Offer the requested ACL line for editing
+	if (!q->acl)
 		return false;
     
-    //Trunc cp var after last return \n
-	*cp++ = '\0';
-    
-	ccs_initial_readline_data = cp;
+	ccs_initial_readline_data = (char *) q->acl;
 	ccs_readline_history_count =
-		ccs_add_history(cp, ccs_readline_history,
+		ccs_add_history(q->acl, ccs_readline_history,
 				ccs_readline_history_count,
 				CCS_MAX_READLINE_HISTORY);
     
     //Read line and auto return (modified readline.c)
 	line = ccs_readline(y, 0, "Enter new entry> ", ccs_readline_history,
 			    ccs_readline_history_count, 128000, 8);
+	ccs_initial_readline_data = NULL;
     
     //The scrollok option controls what happens when the cursor of a window 
     //is moved off the edge of the window or scrolling region
@@ -970,6 +3015,7 @@ static _Bool ccs_handle_query(unsigned int serial)
     //scrollok - enable or disable scrolling on a window
 	scrollok(stdscr, TRUE);
     
+learn_line:
 	ccs_printw("\n");
 	if (!line || !*line) {
 		ccs_printw("\nNone added.\n");
@@ -983,62 +3029,414 @@ static _Bool ccs_handle_query(unsigned int serial)
 				ccs_readline_history_count,
 				CCS_MAX_READLINE_HISTORY);
     
-	if (ccs_network_mode) {
-		fprintf(ccs_domain_fp, "%s%s\n", pidbuf, line);
-		fflush(ccs_domain_fp);
-	} else {
-        //old code 
-		//ret_ignored = write(ccs_domain_policy_fd, pidbuf, strlen(pidbuf));
-		//ret_ignored = write(ccs_domain_policy_fd, line, strlen(line));
-		//ret_ignored = write(ccs_domain_policy_fd, "\n", 1);
-		write(ccs_domain_policy_fd, pidbuf, strlen(pidbuf));
-		write(ccs_domain_policy_fd, line, strlen(line));
-		write(ccs_domain_policy_fd, "\n", 1);
-	}
-    
-	ccs_printw("\nAdded '%s'.\n", line);
+    //The line reaches the kernel with the next batch, a retry could be asked
+    //again before that so the request itself is allowed
+	ccs_normalize_line(line);
+	if (ccs_learn_line(q->domain, line))
+		ccs_printw("\nAdded '%s'.\n", line);
+	else
+		ccs_printw("\nAlready added '%s'.\n", line);
+	c = 'Y';
     
 not_append:
 	free(line);
-    
-write_answer:
-	/* Write answer. */
-	if (c == 'Y' || c == 'y' || c == 'A' || c == 'a')
-		c = 1;
-	else if (c == 'R' || c == 'r')
-		c = 3;
-	else
-		c = 2;
-    
-	snprintf(ccs_buffer, sizeof(ccs_buffer) - 1, "A%u=%u\n", serial, c);
-	//old code
-    //ret_ignored = write(ccs_query_fd, ccs_buffer, strlen(ccs_buffer));
-	write(ccs_query_fd, ccs_buffer, strlen(ccs_buffer));
+	//Remember what the user decided so the same request is not asked again,
+	//an unanswered prompt or a retry decides nothing
+	if (ccs_journal_source(xresult, from_prompt) == CCS_JOURNAL_HUMAN &&
+	    q->is_domain_query && (c == 'Y' || c == 'N'))
+		ccs_decision_store(q->domain, q->acl, c, 0);
+	ccs_write_answer(q, c, ccs_journal_source(xresult, from_prompt), xresult);
+	if (answer)
+		*answer = c;
 	ccs_printw("\n");
 	return true;
-    
-not_domain_query:
-	ccs_printw("Allow? ('Y'es/'N'o/'R'etry):");
-    
-    ccs_send_keepalive();
-    int question = popup_question("Tomoyo : Non domain query request...\nAllow ?", "45");
-    
-    //Default value
-    c = 'N';
-        
-    if (question == 53248) { //Timeout
-        c = 'N';
-    } else {
-        if (question == 25600) { //Yes
-            c = 'Y';
-        } else {
-            c = 'N';
-        }
-    }
-    
-	ccs_printw("%c\n", c);
-	goto write_answer;
-    
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Utility functions - Capture and replay
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// --capture=FILE keeps every query record read, each after a "USEC LENGTH" line
+// giving its arrival time since the first one. --replay=FILE feeds such a file
+// to the query path instead of the kernel, prompts get the --replay-answer=
+// result after --replay-think= msec, and nothing is written to the policy.
+//
+
+static void ccs_capture_record(unsigned long long start)
+{
+	const int len = strlen(ccs_buffer);
+	if (!ccs_capture_start)
+		ccs_capture_start = start;
+	fprintf(ccs_capture_fp, "%llu %d\n", start - ccs_capture_start, len);
+	fwrite(ccs_buffer, 1, len, ccs_capture_fp);
+}
+
+//Scripted answer for a prompt, given by ccs_replay_tick()
+static unsigned int ccs_replay_prompt(int kind)
+{
+	struct ccs_replay_prompt *ptr;
+	if (!++ccs_prompt_id)
+		ccs_prompt_id++;
+	if (kind != CCS_PROMPT_QUERY && kind != CCS_PROMPT_QUESTION)
+		return ccs_prompt_id;
+	ccs_replay_prompts = ccs_realloc(ccs_replay_prompts, (ccs_replay_prompts_len + 1) *
+					 sizeof(struct ccs_replay_prompt));
+	ptr = &ccs_replay_prompts[ccs_replay_prompts_len++];
+	ptr->id = ccs_prompt_id;
+	ptr->due = ccs_usec_now() + ccs_replay_think * 1000ULL;
+	return ptr->id;
+}
+
+//Read the next "USEC LENGTH" line, false at the end of the capture
+static _Bool ccs_replay_header(void)
+{
+	char line[64];
+	if (ccs_replay_ready)
+		return true;
+	if (!fgets(line, sizeof(line), ccs_replay_fp) ||
+	    sscanf(line, "%llu %d", &ccs_replay_offset, &ccs_replay_len) != 2 ||
+	    ccs_replay_len < 0 || ccs_replay_len >= sizeof(ccs_buffer))
+		return false;
+	ccs_replay_ready = true;
+	return true;
+}
+
+static unsigned long long ccs_replay_due(void)
+{
+	if (ccs_replay_speed <= 0)
+		return 0;
+	return ccs_replay_base + ccs_replay_offset / ccs_replay_speed;
+}
+
+//Answer due prompts, feed due records and sleep until the next one, false when done
+static _Bool ccs_replay_tick(void)
+{
+	struct itimerspec its;
+	unsigned long long now = ccs_usec_now();
+	unsigned long long wake = 0;
+	int fed = 0;
+	int i;
+	if (!ccs_replay_started)
+		ccs_replay_started = now;
+	for (i = 0; i < ccs_replay_prompts_len; ) {
+		const unsigned int id = ccs_replay_prompts[i].id;
+		if (ccs_replay_prompts[i].due > now) {
+			i++;
+			continue;
+		}
+		ccs_replay_prompts[i] = ccs_replay_prompts[--ccs_replay_prompts_len];
+		if (!ccs_prompt_answered(id, ccs_replay_result))
+			return false;
+	}
+	while (ccs_replay_header()) {
+		if (!ccs_replay_base)
+			ccs_replay_base = now - (ccs_replay_speed > 0 ?
+						 ccs_replay_offset / ccs_replay_speed : 0);
+		//Let the event loop run between batches when going flat out
+		if (ccs_replay_due() > now || fed == CCS_REPLAY_BATCH) {
+			wake = ccs_replay_due() > now ? ccs_replay_due() : now;
+			break;
+		}
+		memset(ccs_buffer, 0, sizeof(ccs_buffer));
+		if (fread(ccs_buffer, 1, ccs_replay_len, ccs_replay_fp) != ccs_replay_len)
+			break;
+		ccs_replay_ready = false;
+		ccs_replay_count++;
+		fed++;
+		if (!ccs_process_query(ccs_usec_now()))
+			return false;
+	}
+	for (i = 0; i < ccs_replay_prompts_len; i++)
+		if (!wake || ccs_replay_prompts[i].due < wake)
+			wake = ccs_replay_prompts[i].due;
+	if (!wake) {
+		const double secs = (ccs_usec_now() - ccs_replay_started) / 1000000.0;
+		if (ccs_pending_list_len) {
+			ccs_printw(" Replay                           = %d queries left unanswered\n",
+				   ccs_pending_list_len);
+		}
+		ccs_printw("\n Replayed %d queries in %.3f s (%.0f queries/s)\n", ccs_replay_count,
+			   secs, secs > 0 ? ccs_replay_count / secs : 0);
+		//With --stats=FILE main() writes them on the way out
+		if (!ccs_stats_file)
+			ccs_stats_dump();
+		return false;
+	}
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = wake / 1000000;
+	its.it_value.tv_nsec = (wake % 1000000) * 1000 + 1;
+	timerfd_settime(ccs_replay_fd, TFD_TIMER_ABSTIME, &its, NULL);
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Event loop
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void ccs_watch_fd(int fd, _Bool watch)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	epoll_ctl(ccs_epoll_fd, watch ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, fd, &ev);
+}
+
+static void ccs_arm_timer(int fd, int msec, _Bool periodic)
+{
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = msec / 1000;
+	its.it_value.tv_nsec = (msec % 1000) * 1000000;
+	if (periodic)
+		its.it_interval = its.it_value;
+	timerfd_settime(fd, 0, &its, NULL);
+}
+
+//Keepalives reset the kernel's timeout of waiting queries, only needed while prompts are open
+static void ccs_update_keepalive(void)
+{
+	static _Bool armed = false;
+	if (armed == (ccs_pending_list_len > 0))
+		return;
+	armed = !armed;
+	ccs_arm_timer(ccs_keepalive_fd, armed ? 1000 : 0, true);
+}
+
+static void ccs_watch_query(_Bool watch)
+{
+	//Replayed records come from ccs_replay_tick()
+	if (watch == ccs_query_watched || ccs_replay_fp)
+		return;
+	ccs_query_watched = watch;
+	ccs_watch_fd(ccs_query_fd, watch);
+	//The agent only sends a query after being asked for one
+	if (watch && ccs_network_mode && !ccs_query_requested) {
+		write(ccs_query_fd, "", 1);
+		ccs_query_requested = true;
+	}
+}
+
+//All queries the kernel holds were seen, /proc/ccs/query stays readable
+//until one of them is answered. Look again after a while instead of spinning.
+static void ccs_pause_query_scan(void)
+{
+	ccs_scan_started = false;
+	ccs_watch_query(false);
+	ccs_arm_timer(ccs_rescan_fd, CCS_RESCAN_INTERVAL, false);
+}
+
+//One answer from the prompt helper, a dead helper is replaced
+static _Bool ccs_read_prompt_reply(void)
+{
+	struct ccs_prompt_reply reply;
+	const int len = recv(ccs_prompt_fd, &reply, sizeof(reply), MSG_DONTWAIT);
+	int i;
+	if (len == sizeof(reply))
+		return ccs_prompt_answered(reply.id, reply.result);
+	if (len == -1 && (errno == EAGAIN || errno == EINTR))
+		return true;
+	ccs_watch_fd(ccs_prompt_fd, false);
+	close(ccs_prompt_fd);
+	ccs_prompt_fd = EOF;
+	ccs_printw(" Prompt Helper                    = Restarting\n");
+	if (ccs_start_prompt_helper())
+		ccs_watch_fd(ccs_prompt_fd, true);
+	//Its open dialogs are gone, deny what they were asking
+	while (true) {
+		for (i = 0; i < ccs_pending_list_len; i++)
+			if (ccs_pending_list[i].prompt_id)
+				break;
+		if (i == ccs_pending_list_len)
+			break;
+		if (!ccs_prompt_answered(ccs_pending_list[i].prompt_id, 47104))
+			return false;
+	}
+	ccs_quit_prompt_id = 0;
+	return true;
+}
+
+//Handle the record in ccs_buffer, read from the kernel (or a capture) since @start
+static _Bool ccs_process_query(unsigned long long start)
+{
+	const unsigned long long parse_start = ccs_usec_now();
+	struct ccs_query_info q;
+	_Bool parsed;
+	ccs_hist_add(&ccs_stage_hist[CCS_STAGE_READ], parse_start - start);
+	if (ccs_capture_fp)
+		ccs_capture_record(start);
+	parsed = ccs_parse_query(ccs_buffer, &q);
+	ccs_stage_done(CCS_STAGE_PARSE, parse_start);
+	if (!parsed) {
+		if (ccs_buffer[0] != 'Q')
+			return true;
+		fprintf(stderr, "ERROR: Unsupported query.\n");
+		return false;
+	}
+	//The kernel hands out every waiting query in turn, skip the ones already
+	//prompted and keep reading until the pass ends or wraps to its first serial
+	if (ccs_scan_started && q.serial == ccs_scan_first) {
+		ccs_pause_query_scan();
+		return true;
+	}
+	if (!ccs_scan_started) {
+		ccs_scan_first = q.serial;
+		ccs_scan_started = true;
+	}
+	if (ccs_query_known(q.serial))
+		return true;
+	q.received_us = start;
+	return ccs_handle_query(&q) && ccs_check_repeat();
+}
+
+static _Bool ccs_read_query(void)
+{
+	const unsigned long long start = ccs_usec_now();
+	memset(ccs_buffer, 0, sizeof(ccs_buffer));
+	if (ccs_network_mode) {
+		int len;
+		const char *record = ccs_reader_next(&ccs_query_reader, false,
+						     &len, NULL);
+		ccs_query_requested = false;
+		if (!record || len >= sizeof(ccs_buffer))
+			return false;
+		memcpy(ccs_buffer, record, len);
+	} else if (read(ccs_query_fd, ccs_buffer, sizeof(ccs_buffer) - 1) <= 0) {
+		ccs_pause_query_scan();
+		return true;
+	}
+	if (!strchr(ccs_buffer, '\n')) {
+		ccs_pause_query_scan();
+		return true;
+	}
+	if (!ccs_process_query(start))
+		return false;
+	//Unless the pass ended, ask the agent for the next one
+	if (ccs_network_mode && ccs_query_watched) {
+		write(ccs_query_fd, "", 1);
+		ccs_query_requested = true;
+	}
+	return true;
+}
+
+static _Bool ccs_event_loop_init(void)
+{
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGHUP);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	//Started with the signals blocked, they all go to the signalfd
+	if (!ccs_saver_start() || !ccs_journal_start())
+		return false;
+	ccs_signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	ccs_keepalive_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	ccs_rescan_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	ccs_learn_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	ccs_provisional_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (ccs_replay_fp) {
+		ccs_replay_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (ccs_replay_fd == EOF)
+			return false;
+	}
+	ccs_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (ccs_signal_fd == EOF || ccs_keepalive_fd == EOF ||
+	    ccs_rescan_fd == EOF || ccs_learn_fd == EOF ||
+	    ccs_provisional_fd == EOF || ccs_epoll_fd == EOF)
+		return false;
+	ccs_watch_fd(ccs_signal_fd, true);
+	ccs_watch_fd(ccs_keepalive_fd, true);
+	ccs_watch_fd(ccs_rescan_fd, true);
+	ccs_watch_fd(ccs_learn_fd, true);
+	ccs_watch_fd(ccs_provisional_fd, true);
+	ccs_watch_fd(ccs_saver_pipe[0], true);
+	if (ccs_replay_fd != EOF) {
+		ccs_watch_fd(ccs_replay_fd, true);
+		ccs_arm_timer(ccs_replay_fd, 1, false);
+	}
+	if (ccs_frame_fd != EOF)
+		ccs_watch_fd(ccs_frame_fd, true);
+	if (ccs_prompt_fd != EOF)
+		ccs_watch_fd(ccs_prompt_fd, true);
+	if (!ccs_headless && isatty(0))
+		ccs_watch_fd(0, true);
+	ccs_watch_query(true);
+	return true;
+}
+
+//Returns when the query stream is gone, a query asks to quit or on SIGTERM/SIGINT
+static void ccs_event_loop(void)
+{
+	while (true) {
+		struct epoll_event events[16];
+		int i;
+		int n;
+		//Everything logged while handling the previous events goes out in one write
+		if (ccs_headless)
+			ccs_log_flush();
+		if (ccs_capture_fp)
+			fflush(ccs_capture_fp);
+		n = epoll_wait(ccs_epoll_fd, events, 16, -1);
+		if (n < 0 && errno != EINTR)
+			return;
+		for (i = 0; i < n; i++) {
+			const int fd = events[i].data.fd;
+			unsigned long long expirations;
+			if (fd == ccs_query_fd) {
+				if (ccs_query_watched && !ccs_read_query())
+					return;
+			} else if (fd == ccs_signal_fd) {
+				struct signalfd_siginfo info;
+				while (read(fd, &info, sizeof(info)) == sizeof(info))
+					if (info.ssi_signo == SIGUSR1)
+						ccs_stats_dump();
+					else if (info.ssi_signo == SIGHUP) {
+						//Policy edited behind our back, queued lines go first
+						ccs_learn_flush();
+						ccs_mirror_load();
+					} else if (info.ssi_signo != SIGCHLD)
+						return;
+				ccs_reap_children();
+			} else if (fd == ccs_prompt_fd) {
+				if (!ccs_read_prompt_reply())
+					return;
+			} else if (fd == ccs_keepalive_fd) {
+				if (read(fd, &expirations, sizeof(expirations)) > 0)
+					ccs_send_keepalive();
+			} else if (fd == ccs_rescan_fd) {
+				if (read(fd, &expirations, sizeof(expirations)) > 0)
+					ccs_watch_query(true);
+			} else if (fd == ccs_saver_pipe[0]) {
+				int result;
+				while (read(fd, &result, sizeof(result)) == sizeof(result))
+					show_save_result(result);
+			} else if (fd == ccs_frame_fd) {
+				if (read(fd, &expirations, sizeof(expirations)) > 0)
+					ccs_repaint();
+			} else if (fd == ccs_learn_fd) {
+				if (read(fd, &expirations, sizeof(expirations)) > 0)
+					ccs_learn_flush();
+			} else if (fd == ccs_provisional_fd) {
+				if (read(fd, &expirations, sizeof(expirations)) > 0)
+					ccs_provisional_expire();
+			} else if (fd == ccs_replay_fd) {
+				if (read(fd, &expirations, sizeof(expirations)) > 0 &&
+				    !ccs_replay_tick())
+					return;
+			} else if (fd == 0) {
+				/* Clear pending input. */
+				timeout(0);
+				while (true) {
+					int c = ccs_getch2();
+					if (c == EOF || c == ERR) break;
+					if (c == KEY_RESIZE) ccs_repaint();
+				}
+			}
+		}
+	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -1047,22 +3445,100 @@ not_domain_query:
 
 int main(int argc, char *argv[])
 {
-	if (argc == 1)
-		goto ok;
-	{
-		char *cp = strchr(argv[1], ':');
-		if (cp) {
+	int i;
+	//Started by ccs_start_prompt_helper()
+	if (argc == 2 && !strncmp(argv[1], "--prompt-helper=", 16)) {
+		//Started as /proc/self/exe, keep the name ps and pkill know
+		prctl(PR_SET_NAME, "ccs-firewall");
+		//Statistics requests are for the daemon, "pkill -USR1" reaches us too
+		signal(SIGUSR1, SIG_IGN);
+		ccs_find_session();
+		ccs_prompt_helper(atoi(argv[1] + 16));
+		return 0;
+	}
+	for (i = 1; i < argc; i++) {
+		char *arg = argv[i];
+		char *cp = strchr(arg, ':');
+		if (ccs_str_starts(arg, "--cache-size="))
+			ccs_decision_capacity = atoi(arg);
+		else if (ccs_str_starts(arg, "--cache-allow-ttl="))
+			ccs_decision_allow_ttl = atoi(arg);
+		else if (ccs_str_starts(arg, "--cache-deny-ttl="))
+			ccs_decision_deny_ttl = atoi(arg);
+		else if (ccs_str_starts(arg, "--generalize="))
+			ccs_generalize_min = atoi(arg);
+		else if (ccs_str_starts(arg, "--learn-time="))
+			ccs_learn_session_time = atoi(arg);
+		else if (ccs_str_starts(arg, "--learn-lines="))
+			ccs_learn_session_lines = atoi(arg);
+		else if (ccs_str_starts(arg, "--provisional="))
+			ccs_provisional_deadline = atoi(arg);
+		else if (ccs_str_starts(arg, "--provisional-retries="))
+			ccs_provisional_retries = atoi(arg);
+		else if (ccs_str_starts(arg, "--rules="))
+			ccs_rules_file = arg;
+		else if (ccs_str_starts(arg, "--save-delay="))
+			ccs_saver_delay = atoi(arg);
+		else if (ccs_str_starts(arg, "--journal="))
+			ccs_journal_file = arg;
+		else if (ccs_str_starts(arg, "--stats="))
+			ccs_stats_file = arg;
+		else if (ccs_str_starts(arg, "--capture=")) {
+			ccs_capture_fp = fopen(arg, "w");
+			if (!ccs_capture_fp) {
+				fprintf(stderr, "Can't open %s for writing.\n", arg);
+				return 1;
+			}
+			setvbuf(ccs_capture_fp, NULL, _IOFBF, CCS_CAPTURE_BUFFER);
+		} else if (ccs_str_starts(arg, "--replay=")) {
+			ccs_replay_fp = fopen(arg, "r");
+			if (!ccs_replay_fp) {
+				fprintf(stderr, "Can't open %s for reading.\n", arg);
+				return 1;
+			}
+		} else if (ccs_str_starts(arg, "--replay-speed="))
+			ccs_replay_speed = atof(arg);
+		else if (ccs_str_starts(arg, "--replay-think="))
+			ccs_replay_think = atoi(arg);
+		else if (ccs_str_starts(arg, "--replay-answer=")) {
+			if (!strcmp(arg, "allow"))
+				ccs_replay_result = 36864;
+			else if (!strcmp(arg, "deny"))
+				ccs_replay_result = 22528;
+			else if (!strcmp(arg, "learn"))
+				ccs_replay_result = 25600;
+			else if (!strcmp(arg, "allow-all"))
+				ccs_replay_result = 11264;
+			else if (!strcmp(arg, "deny-all"))
+				ccs_replay_result = 62464;
+			else if (!strcmp(arg, "timeout"))
+				ccs_replay_result = 53248;
+			else
+				goto usage;
+		}
+		else if (!strcmp(arg, "--daemon"))
+			ccs_headless = true;
+		else if (ccs_str_starts(arg, "--log=")) {
+			ccs_log_fd = open(arg, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+			if (ccs_log_fd == EOF) {
+				fprintf(stderr, "Can't open %s for writing.\n", arg);
+				return 1;
+			}
+		}
+		else if (cp && !ccs_network_mode) {
 			*cp++ = '\0';
-			ccs_network_ip = inet_addr(argv[1]);
+			ccs_network_ip = inet_addr(arg);
 			ccs_network_port = htons(atoi(cp));
 			ccs_network_mode = true;
 			if (!ccs_check_remote_host())
 				return 1;
-			goto ok;
-		}
+		} else
+			goto usage;
 	}
+	goto ok;
     
-	printf("Usage: %s [remote_ip:remote_port]\n\n", argv[0]);
+usage:
+	printf("Usage: %s [options] [remote_ip:remote_port]\n\n", argv[0]);
 	printf("This program is used for granting access requests manually."
 	       "\n");
 	printf("This program shows access requests that are about to be "
@@ -1072,13 +3548,45 @@ int main(int argc, char *argv[])
 	printf("You can use this program to respond to accidental access "
 	       "requests triggered by non-routine tasks (such as restarting "
 	       "daemons after updating).\n");
-	printf("To terminate this program, use 'Ctrl-C'.\n");
+	printf("To terminate this program, use 'Ctrl-C'.\n\n");
+	printf("Options:\n");
+	printf("  --cache-size=N          Remember up to N answers (default 1024, 0 disables).\n");
+	printf("  --cache-allow-ttl=SEC   Forget allowed requests after SEC seconds (default 3600).\n");
+	printf("  --cache-deny-ttl=SEC    Forget denied requests after SEC seconds (default 600).\n");
+	printf("  --generalize=N          Learn a pattern (\\$, \\X, \\*, \\{\\*\\}) instead of N or more lines it covers.\n");
+	printf("  --learn-time=SEC        Allow & Learn learns the domain for SEC seconds (default 120).\n");
+	printf("  --learn-lines=N         or until N lines were learned (default 256).\n");
+	printf("  --provisional=SEC       Deny requests still asked about after SEC seconds, the answer is kept for next time.\n");
+	printf("  --provisional-retries=N Ask the kernel to retry instead, up to N times per request (default 0).\n");
+	printf("  --rules=FILE            Answer requests matching the rules in FILE without asking.\n");
+	printf("  --save-delay=MSEC       Write policy saves requested within MSEC together (default 2000).\n");
+	printf("  --journal=FILE          Append every answer to FILE, answers still cached are read back at startup.\n");
+	printf("  --stats=FILE            Write latency histograms to FILE on SIGUSR1 and at exit (default: the log).\n");
+	printf("  --capture=FILE          Keep every request read in FILE, with its arrival time.\n");
+	printf("  --replay=FILE           Handle the requests captured in FILE instead of the kernel's, nothing is written.\n");
+	printf("  --replay-speed=N        Replay N times as fast as captured (default 1, 0 is as fast as possible).\n");
+	printf("  --replay-answer=ANSWER  allow, deny, learn, allow-all, deny-all or timeout, given to every prompt (default allow).\n");
+	printf("  --replay-think=MSEC     Answer prompts MSEC after they open (default 0).\n");
+	printf("  --daemon                Don't use the terminal, log to stderr (the default without a terminal).\n");
+	printf("  --log=FILE              Log to FILE instead of stderr in daemon mode.\n");
 	return 0;
     
 ok:
-	if (ccs_network_mode) {
+	if (ccs_rules_file && !ccs_load_rules(ccs_rules_file))
+		return 1;
+	if (ccs_journal_file && !ccs_journal_open(ccs_journal_file))
+		return 1;
+	//Before opening the query interface, the helper must not hold it
+	if (!ccs_replay_fp && !ccs_start_prompt_helper())
+		fprintf(stderr, "Can't start the prompt helper, requests will be denied.\n");
+	if (ccs_replay_fp) {
+		//Answers and learned lines go nowhere
+		ccs_network_mode = false;
+		ccs_query_fd = open("/dev/null", O_RDWR);
+		ccs_domain_policy_fd = open("/dev/null", O_RDWR);
+	} else if (ccs_network_mode) {
 		ccs_query_fd = ccs_open_stream("proc:query");
-		ccs_domain_fp = ccs_open_write(CCS_PROC_POLICY_DOMAIN_POLICY);
+		ccs_reader_init(&ccs_query_reader, ccs_query_fd);
 	} else {
 		ccs_query_fd = open(CCS_PROC_POLICY_QUERY, O_RDWR);
 		ccs_domain_policy_fd = open(CCS_PROC_POLICY_DOMAIN_POLICY, O_RDWR);
@@ -1088,7 +3596,7 @@ ok:
 		fprintf(stderr,"You can't run this utility for this kernel.\n");
         popup_warning("Tomoyo : You can't run this utility for this kernel","45");
 		return 1;
-	} else if (!ccs_network_mode && write(ccs_query_fd, "", 0) != 0) {
+	} else if (!ccs_network_mode && !ccs_replay_fp && write(ccs_query_fd, "", 0) != 0) {
         char message[32768] = "";
 		fprintf(stderr, "You need to register this program to %s to run this program.\n", CCS_PROC_POLICY_MANAGER);
         //Popup Warning
@@ -1100,15 +3608,24 @@ ok:
 	}
     
 	ccs_readline_history = ccs_malloc(CCS_MAX_READLINE_HISTORY * sizeof(const char *));
+	if (!ccs_replay_fp)
+		ccs_mirror_load();
     
 	ccs_send_keepalive();
     
+    //Curses only with a terminal to draw on
+	if (!isatty(1))
+		ccs_headless = true;
+	if (ccs_headless)
+		goto monitor;
+    
     //Curses - initscr is normally the first curses routine to call when initializing a program. 
     //A few special routines sometimes need to be called before it; these are slk_init, filter, 
     //ripoffline, use_env. For multiple-terminal applications, newterm may be called before initscr. 
     //A program that outputs to more than one terminal should use the newterm routine 
     //for each terminal instead of initscr
 	initscr();
+	ccs_frame_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
     
     //Curses - The cbreak routine disables line buffering and erase/kill character-processing 
     //(interrupt and flow control characters are unaffected), making characters typed by 
@@ -1167,8 +3684,11 @@ ok:
     //is also necessary to call idlok).
 	scrollok(stdscr, TRUE);
     
+monitor:
     //Start monitoring
-	if (ccs_network_mode) {
+	if (ccs_replay_fp) {
+		ccs_printw("Replaying captured /proc/ccs/query requests .");
+	} else if (ccs_network_mode) {
 		const u32 ip = ntohl(ccs_network_ip);
 		ccs_printw("Monitoring /proc/ccs/query via %u.%u.%u.%u:%u.",
 			   (u8) (ip >> 24), (u8) (ip >> 16), (u8) (ip >> 8),
@@ -1180,55 +3700,26 @@ ok:
 	ccs_printw(" Press Ctrl-C to terminate.\n\n");
     
     //Main monitoring 
-	while (true) {
-		unsigned int serial;
-		char *cp;
-        
-		/* Wait for query and read query. */
-		memset(ccs_buffer, 0, sizeof(ccs_buffer));
-		if (ccs_network_mode) {
-			int i;
-			//int ret_ignored; //old code
-			//ret_ignored = write(ccs_query_fd, "", 1); //old code
-			write(ccs_query_fd, "", 1);
-			for (i = 0; i < sizeof(ccs_buffer) - 1; i++) {
-				if (read(ccs_query_fd, ccs_buffer + i, 1) != 1) break;
-				if (!ccs_buffer[i])	goto read_ok;
-			}
-			break;
-		} else {
-			struct pollfd pfd;
-			pfd.fd = ccs_query_fd;
-			pfd.events = POLLIN;
-			pfd.revents = 0;
-			poll(&pfd, 1, -1);
-			if (!(pfd.revents & POLLIN)) continue;
-			if (read(ccs_query_fd, ccs_buffer, sizeof(ccs_buffer) - 1) <= 0) continue;
-		}
-        
-read_ok:
-		cp = strchr(ccs_buffer, '\n');
-		if (!cp) continue;
-        //Cut variable
-		*cp = '\0';
-
-		/* Get query number. */
-		if (sscanf(ccs_buffer, "Q%u-%hu", &serial, &ccs_retries) != 2) continue;
-		memmove(ccs_buffer, cp + 1, strlen(cp + 1) + 1);
-
-		/* Clear pending input. */;
-		timeout(0);
-		while (true) {
-			int c = ccs_getch2();
-			if (c == EOF || c == ERR) break;
-		}
-		timeout(1000);
-		if (ccs_handle_query(serial)) continue;
-		break;
+	if (!ccs_event_loop_init()) {
+		if (!ccs_headless)
+			endwin();
+		ccs_log_flush();
+		fprintf(stderr, "Can't set up the event loop.\n");
+		return 1;
 	}
+	ccs_event_loop();
+	ccs_learn_flush();
+	ccs_saver_flush();
+	ccs_journal_flush();
+	if (ccs_capture_fp)
+		fclose(ccs_capture_fp);
+	if (ccs_stats_file)
+		ccs_stats_dump();
     
     //Curses - 
-	endwin();
+	if (!ccs_headless)
+		endwin();
+	ccs_log_flush();
 	return 0;
 }
 
@@ -0,0 +1,669 @@
+/*
+ * ccs-queryemu.c
+ *
+ * TOMOYO Linux's utilities.
+ *
+ * Copyright (C) 2005-2011  NTT DATA CORPORATION
+ *
+ * Version: 1.8.5   2015/11/11
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+#include "ccstools.h"
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <netinet/tcp.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Main variables
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Stands in for a TOMOYO kernel behind ccs-editpolicy-agent, so ccs-firewall
+// can be load tested with "ccs-firewall 127.0.0.1:7001" on any Linux box.
+//
+// "proc:query" hands out generated Q<serial>-<retry> records, one per NUL
+// written, and takes A<serial>=<n> answers. Like the kernel, waiting queries
+// are handed out in turn and an empty record ends each pass. Any write to the
+// query stream resets the waiting queries' timeout, a query left alone for
+// --timeout= is denied. Answer 3 asks the query again with retry + 1.
+//
+// "/proc/ccs/domain_policy" keeps the written policy ("select domain=",
+// "select Q=", "use_profile", "delete ") in memory and sends it back when read.
+// Queries whose ACL line is already allowed there are not asked.
+//
+
+//A query the "kernel" is waiting on
+struct ccs_emu_query {
+	unsigned int serial;
+	unsigned short int retry;
+	unsigned int domain;                  //Index in ccs_emu_domains
+	const struct ccs_path_info *acl;      //ccs_savename()'d
+	unsigned long long created_us;        //For the latency of the answer
+	unsigned long long deadline_us;
+};
+static struct ccs_emu_query *ccs_emu_queries = NULL;   //Sorted by serial
+static int ccs_emu_queries_len = 0;
+
+//One connection from ccs-firewall, named by the first NUL-terminated string
+enum ccs_emu_stream {
+	CCS_EMU_HANDSHAKE,
+	CCS_EMU_QUERY,        //"proc:query"
+	CCS_EMU_POLICY,       //"/proc/ccs/domain_policy"
+	CCS_EMU_VERSION,      //"version", ccs_check_remote_host()
+	CCS_EMU_OTHER,        //Written data is dropped
+};
+struct ccs_emu_client {
+	int fd;
+	int stream;
+	char *line;           //Incomplete line or name
+	int line_len;
+	int line_size;
+	int selected;         //Policy: ccs_emu_policy domain index, EOF if none
+	unsigned int cursor;  //Query: serial of the last query handed out
+	_Bool waiting;        //Query: asked for a query while none was waiting
+};
+
+//Generated requests, domain i asks for the ACL lines i, i + domains, ...
+static const struct ccs_path_info **ccs_emu_domains = NULL;
+static int ccs_emu_domain_count = 16;         //--domains=
+static int ccs_emu_path_count = 256;          //--paths=
+static unsigned int ccs_emu_next = 0;         //Requests made so far
+static unsigned int ccs_emu_serial = 0;
+static unsigned int ccs_emu_count = 10000;    //--count=, 0 runs until killed
+static int ccs_emu_rate = 1000;               //--rate=, per second, 0 = as fast as answered
+static int ccs_emu_outstanding = 64;          //--outstanding=, waiting queries at most
+static int ccs_emu_timeout = 10000;           //--timeout=, msec
+static unsigned long long ccs_emu_start_us = 0;
+static struct ccs_domain_policy ccs_emu_policy = { NULL, 0, NULL };
+
+//Results
+static unsigned int ccs_emu_allowed = 0;
+static unsigned int ccs_emu_denied = 0;
+static unsigned int ccs_emu_retried = 0;
+static unsigned int ccs_emu_timed_out = 0;
+static unsigned int ccs_emu_granted = 0;      //Not asked, allowed by the policy
+static unsigned int *ccs_emu_latency = NULL;  //usec from query to answer, one per answer
+static int ccs_emu_latency_len = 0;
+static unsigned long long ccs_emu_last_answer_us = 0;
+
+static int ccs_emu_epoll_fd = EOF;
+static int ccs_emu_listen_fd = EOF;
+static int ccs_emu_tick_fd = EOF;
+static struct ccs_emu_client **ccs_emu_clients = NULL;
+static int ccs_emu_clients_len = 0;
+#define CCS_EMU_TICK 1                        //msec between generation and timeout passes
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Utility functions - Time
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static unsigned long long ccs_emu_usec_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Utility functions - Domain policy
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static int ccs_emu_find_query(unsigned int serial)
+{
+	int i;
+	for (i = 0; i < ccs_emu_queries_len; i++)
+		if (ccs_emu_queries[i].serial == serial)
+			return i;
+	return EOF;
+}
+
+//One line written to domain_policy by @client
+static void ccs_emu_policy_line(struct ccs_emu_client *client, char *line)
+{
+	unsigned int profile;
+	unsigned int serial;
+	_Bool is_delete;
+	ccs_normalize_line(line);
+	if (ccs_str_starts(line, "select ")) {
+		client->selected = EOF;
+		if (ccs_str_starts(line, "domain=")) {
+			if (ccs_correct_domain(line))
+				client->selected = ccs_assign_domain(&ccs_emu_policy, line);
+		} else if (sscanf(line, "Q=%u", &serial) == 1) {
+			const int i = ccs_emu_find_query(serial);
+			if (i != EOF)
+				client->selected = ccs_assign_domain(&ccs_emu_policy,
+					ccs_emu_domains[ccs_emu_queries[i].domain]->name);
+		}
+		return;
+	}
+	if (client->selected == EOF || !line[0])
+		return;
+	is_delete = ccs_str_starts(line, "delete ");
+	if (sscanf(line, "use_profile %u", &profile) == 1) {
+		ccs_emu_policy.list[client->selected].profile = (u8) profile;
+		ccs_emu_policy.list[client->selected].profile_assigned = 1;
+	} else if (is_delete)
+		ccs_del_string_entry(&ccs_emu_policy, line, client->selected);
+	else
+		ccs_add_string_entry(&ccs_emu_policy, line, client->selected);
+}
+
+//Would the kernel allow @acl in @domain without asking?
+static _Bool ccs_emu_allowed_by_policy(const struct ccs_path_info *domain,
+				       const struct ccs_path_info *acl)
+{
+	const int index = ccs_find_domain_by_ptr(&ccs_emu_policy, domain);
+	const struct ccs_domain_info *ptr;
+	int i;
+	if (index == EOF)
+		return false;
+	ptr = &ccs_emu_policy.list[index];
+	for (i = 0; i < ptr->string_count; i++)
+		if (ptr->string_ptr[i] == acl ||
+		    (ptr->string_ptr[i]->is_patterned &&
+		     ccs_path_matches_pattern(acl, ptr->string_ptr[i])))
+			return true;
+	return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Utility functions - Queries
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void ccs_emu_send(struct ccs_emu_client *client, const char *data, int len)
+{
+	while (len > 0) {
+		const int done = write(client->fd, data, len);
+		if (done <= 0) {
+			if (done == -1 && errno == EINTR)
+				continue;
+			return;
+		}
+		data += done;
+		len -= done;
+	}
+}
+
+//Hand the next waiting query to @client, false if none is waiting at all
+static _Bool ccs_emu_send_query(struct ccs_emu_client *client)
+{
+	static char record[8192];
+	const struct ccs_emu_query *q = NULL;
+	const char *domain;
+	time_t now;
+	struct tm tm;
+	int len;
+	int i;
+	if (!ccs_emu_queries_len)
+		return false;
+	for (i = 0; i < ccs_emu_queries_len; i++)
+		if (ccs_emu_queries[i].serial > client->cursor) {
+			q = &ccs_emu_queries[i];
+			break;
+		}
+	//End of the pass
+	if (!q) {
+		client->cursor = 0;
+		ccs_emu_send(client, "", 1);
+		return true;
+	}
+	client->cursor = q->serial;
+	domain = ccs_emu_domains[q->domain]->name;
+	now = time(NULL);
+	gmtime_r(&now, &tm);
+	len = snprintf(record, sizeof(record) - 1, "Q%u-%hu\n"
+		       "#%04d/%02d/%02d %02d:%02d:%02d# profile=1 mode=enforcing "
+		       "(global-pid=%u) task={ pid=%u ppid=1 uid=0 gid=0 euid=0 "
+		       "egid=0 suid=0 sgid=0 fsuid=0 fsgid=0 "
+		       "type!=execute_handler } exe=\"%s\"\n%s\n%s\n",
+		       q->serial, q->retry, tm.tm_year + 1900, tm.tm_mon + 1,
+		       tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+		       1000 + q->domain, 1000 + q->domain, strchr(domain, '/'),
+		       domain, q->acl->name);
+	ccs_emu_send(client, record, len + 1);
+	return true;
+}
+
+static void ccs_emu_wake_clients(void)
+{
+	int i;
+	for (i = 0; i < ccs_emu_clients_len; i++) {
+		struct ccs_emu_client *client = ccs_emu_clients[i];
+		if (client->waiting && ccs_emu_send_query(client))
+			client->waiting = false;
+	}
+}
+
+static void ccs_emu_remove_query(int index)
+{
+	memmove(&ccs_emu_queries[index], &ccs_emu_queries[index + 1],
+		(ccs_emu_queries_len - index - 1) * sizeof(struct ccs_emu_query));
+	ccs_emu_queries_len--;
+}
+
+static void ccs_emu_add_query(const struct ccs_emu_query *q)
+{
+	int i = ccs_emu_queries_len;
+	ccs_emu_queries = ccs_realloc(ccs_emu_queries, (ccs_emu_queries_len + 1) *
+				      sizeof(struct ccs_emu_query));
+	while (i > 0 && ccs_emu_queries[i - 1].serial > q->serial) {
+		ccs_emu_queries[i] = ccs_emu_queries[i - 1];
+		i--;
+	}
+	ccs_emu_queries[i] = *q;
+	ccs_emu_queries_len++;
+}
+
+//Make the requests --rate= asks for by now, as far as --outstanding= lets us
+static void ccs_emu_generate(unsigned long long now)
+{
+	unsigned long long due = ccs_emu_count ? ccs_emu_count : ~0U;
+	_Bool added = false;
+	if (ccs_emu_rate) {
+		const unsigned long long by_now = (now - ccs_emu_start_us) *
+			ccs_emu_rate / 1000000 + 1;
+		if (by_now < due)
+			due = by_now;
+	}
+	while (ccs_emu_next < due && ccs_emu_queries_len < ccs_emu_outstanding) {
+		static char acl[128];
+		struct ccs_emu_query q;
+		const unsigned int path = (ccs_emu_next / ccs_emu_domain_count) %
+			ccs_emu_path_count;
+		q.domain = ccs_emu_next % ccs_emu_domain_count;
+		ccs_emu_next++;
+		if (path % 4 == 3)
+			snprintf(acl, sizeof(acl), "network inet stream connect "
+				 "10.0.%u.%u 443", path / 256, path % 256);
+		else
+			snprintf(acl, sizeof(acl), "file read /srv/emu/data%u", path);
+		q.acl = ccs_savename(acl);
+		if (ccs_emu_allowed_by_policy(ccs_emu_domains[q.domain], q.acl)) {
+			ccs_emu_granted++;
+			continue;
+		}
+		q.serial = ++ccs_emu_serial;
+		q.retry = 0;
+		q.created_us = now;
+		q.deadline_us = now + ccs_emu_timeout * 1000ULL;
+		ccs_emu_add_query(&q);
+		added = true;
+	}
+	if (added)
+		ccs_emu_wake_clients();
+}
+
+//Queries nobody wrote to the query stream about for --timeout= are denied
+static void ccs_emu_expire(unsigned long long now)
+{
+	int i = 0;
+	while (i < ccs_emu_queries_len) {
+		if (ccs_emu_queries[i].deadline_us > now) {
+			i++;
+			continue;
+		}
+		ccs_emu_timed_out++;
+		ccs_emu_remove_query(i);
+	}
+}
+
+//"A<serial>=<n>", 1 allows, 2 denies, 3 asks again
+static void ccs_emu_answer(const char *line, unsigned long long now)
+{
+	unsigned int serial;
+	unsigned int answer;
+	struct ccs_emu_query q;
+	int i;
+	if (sscanf(line, "A%u=%u", &serial, &answer) != 2)
+		return;
+	i = ccs_emu_find_query(serial);
+	if (i == EOF)
+		return;
+	q = ccs_emu_queries[i];
+	ccs_emu_remove_query(i);
+	ccs_emu_latency = ccs_realloc(ccs_emu_latency, (ccs_emu_latency_len + 1) *
+				      sizeof(unsigned int));
+	ccs_emu_latency[ccs_emu_latency_len++] = now - q.created_us;
+	ccs_emu_last_answer_us = now;
+	if (answer == 1) {
+		ccs_emu_allowed++;
+	} else if (answer == 3) {
+		ccs_emu_retried++;
+		q.retry++;
+		q.created_us = now;
+		q.deadline_us = now + ccs_emu_timeout * 1000ULL;
+		ccs_emu_add_query(&q);
+		ccs_emu_wake_clients();
+	} else {
+		ccs_emu_denied++;
+	}
+}
+
+//Every write to /proc/ccs/query restarts the waiting queries' timeout
+static void ccs_emu_touch(unsigned long long now)
+{
+	int i;
+	for (i = 0; i < ccs_emu_queries_len; i++)
+		ccs_emu_queries[i].deadline_us = now + ccs_emu_timeout * 1000ULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Utility functions - Connections
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void ccs_emu_close(struct ccs_emu_client *client)
+{
+	int i;
+	for (i = 0; i < ccs_emu_clients_len; i++)
+		if (ccs_emu_clients[i] == client)
+			ccs_emu_clients[i] = ccs_emu_clients[--ccs_emu_clients_len];
+	epoll_ctl(ccs_emu_epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+	close(client->fd);
+	free(client->line);
+	free(client);
+}
+
+static void ccs_emu_accept(void)
+{
+	struct ccs_emu_client *client;
+	struct epoll_event ev;
+	const int one = 1;
+	const int fd = accept4(ccs_emu_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd == EOF)
+		return;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	client = ccs_malloc(sizeof(*client));
+	memset(client, 0, sizeof(*client));
+	client->fd = fd;
+	client->stream = CCS_EMU_HANDSHAKE;
+	client->selected = EOF;
+	ccs_emu_clients = ccs_realloc(ccs_emu_clients, (ccs_emu_clients_len + 1) *
+				      sizeof(struct ccs_emu_client *));
+	ccs_emu_clients[ccs_emu_clients_len++] = client;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = client;
+	epoll_ctl(ccs_emu_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+//The NUL-terminated name @client opened, acknowledged with a NUL
+static void ccs_emu_handshake(struct ccs_emu_client *client, const char *name)
+{
+	const int len = strlen(name);
+	if (!strcmp(name, "proc:query"))
+		client->stream = CCS_EMU_QUERY;
+	else if (!strcmp(name, "version"))
+		client->stream = CCS_EMU_VERSION;
+	else if (len >= 13 && !strcmp(name + len - 13, "domain_policy"))
+		client->stream = CCS_EMU_POLICY;
+	else
+		client->stream = CCS_EMU_OTHER;
+	ccs_emu_send(client, "", 1);
+}
+
+//What a NUL means after the handshake
+static void ccs_emu_nul(struct ccs_emu_client *client)
+{
+	switch (client->stream) {
+	case CCS_EMU_QUERY:
+		if (!ccs_emu_send_query(client))
+			client->waiting = true;
+		break;
+	case CCS_EMU_VERSION:
+		ccs_emu_send(client, "1.8.5", 6);
+		break;
+	case CCS_EMU_POLICY:
+		//Like the agent, also after writes (ccs_close_write() reads one byte of it)
+		ccs_write_domain_policy(&ccs_emu_policy, client->fd);
+		ccs_emu_send(client, "", 1);
+		break;
+	default:
+		ccs_emu_send(client, "", 1);
+		break;
+	}
+}
+
+static _Bool ccs_emu_read(struct ccs_emu_client *client)
+{
+	static char buf[65536];
+	const unsigned long long now = ccs_emu_usec_now();
+	const int len = read(client->fd, buf, sizeof(buf));
+	int i;
+	if (len <= 0)
+		return len == -1 && errno == EINTR;
+	if (client->stream == CCS_EMU_QUERY)
+		ccs_emu_touch(now);
+	for (i = 0; i < len; i++) {
+		const int stream = client->stream;
+		const char c = buf[i];
+		if (c && c != '\n') {
+			if (client->line_len + 1 >= client->line_size) {
+				client->line_size += 4096;
+				client->line = ccs_realloc(client->line,
+							   client->line_size);
+			}
+			client->line[client->line_len++] = c;
+			continue;
+		}
+		if (client->line)
+			client->line[client->line_len] = '\0';
+		if (stream == CCS_EMU_HANDSHAKE) {
+			if (!c)
+				ccs_emu_handshake(client, client->line ?
+						  client->line : "");
+			else
+				continue;
+		} else if (client->line_len) {
+			if (stream == CCS_EMU_QUERY)
+				ccs_emu_answer(client->line, now);
+			else if (stream == CCS_EMU_POLICY)
+				ccs_emu_policy_line(client, client->line);
+		}
+		client->line_len = 0;
+		if (!c && stream != CCS_EMU_HANDSHAKE)
+			ccs_emu_nul(client);
+	}
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Utility functions - Results
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static int ccs_emu_uint_compare(const void *a, const void *b)
+{
+	const unsigned int x = *(const unsigned int *) a;
+	const unsigned int y = *(const unsigned int *) b;
+	return x < y ? -1 : x > y;
+}
+
+static unsigned int ccs_emu_percentile(double p)
+{
+	int i;
+	if (!ccs_emu_latency_len)
+		return 0;
+	i = ccs_emu_latency_len * p / 100;
+	if (i >= ccs_emu_latency_len)
+		i = ccs_emu_latency_len - 1;
+	return ccs_emu_latency[i];
+}
+
+static void ccs_emu_report(void)
+{
+	const unsigned long long end = ccs_emu_last_answer_us ?
+		ccs_emu_last_answer_us : ccs_emu_usec_now();
+	const double secs = (end - ccs_emu_start_us) / 1000000.0;
+	qsort(ccs_emu_latency, ccs_emu_latency_len, sizeof(unsigned int),
+	      ccs_emu_uint_compare);
+	printf("Requests     %u made, %u allowed by policy, %u asked\n",
+	       ccs_emu_next, ccs_emu_granted, ccs_emu_serial);
+	printf("Answers      %u allow, %u deny, %u retry, %u timed out, %d waiting\n",
+	       ccs_emu_allowed, ccs_emu_denied, ccs_emu_retried,
+	       ccs_emu_timed_out, ccs_emu_queries_len);
+	printf("Throughput   %.0f answers/s over %.3f s\n",
+	       secs > 0 ? ccs_emu_latency_len / secs : 0, secs);
+	printf("Latency usec p50 %u  p90 %u  p99 %u  p99.9 %u  max %u\n",
+	       ccs_emu_percentile(50), ccs_emu_percentile(90),
+	       ccs_emu_percentile(99), ccs_emu_percentile(99.9),
+	       ccs_emu_percentile(100));
+	fflush(stdout);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Main start functionS
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_in addr;
+	struct epoll_event ev;
+	sigset_t mask;
+	int signal_fd;
+	const int one = 1;
+	int i;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(7001);
+	for (i = 1; i < argc; i++) {
+		char *arg = argv[i];
+		char *cp = strchr(arg, ':');
+		if (ccs_str_starts(arg, "--count="))
+			ccs_emu_count = atoi(arg);
+		else if (ccs_str_starts(arg, "--rate="))
+			ccs_emu_rate = atoi(arg);
+		else if (ccs_str_starts(arg, "--outstanding="))
+			ccs_emu_outstanding = atoi(arg);
+		else if (ccs_str_starts(arg, "--timeout="))
+			ccs_emu_timeout = atoi(arg);
+		else if (ccs_str_starts(arg, "--domains="))
+			ccs_emu_domain_count = atoi(arg);
+		else if (ccs_str_starts(arg, "--paths="))
+			ccs_emu_path_count = atoi(arg);
+		else if (ccs_str_starts(arg, "--policy="))
+			ccs_read_domain_policy(&ccs_emu_policy, arg);
+		else if (cp) {
+			*cp++ = '\0';
+			addr.sin_addr.s_addr = inet_addr(arg);
+			addr.sin_port = htons(atoi(cp));
+		} else
+			goto usage;
+	}
+	if (ccs_emu_domain_count > 0 && ccs_emu_path_count > 0 &&
+	    ccs_emu_outstanding > 0 && ccs_emu_rate >= 0)
+		goto ok;
+
+usage:
+	printf("Usage: %s [options] [listen_ip:listen_port]\n\n", argv[0]);
+	printf("This program stands in for the kernel behind ccs-editpolicy-agent "
+	       "(127.0.0.1:7001 by default).\n");
+	printf("Point ccs-firewall at it to measure how fast and how soon requests "
+	       "are answered.\n\n");
+	printf("Options:\n");
+	printf("  --count=N               Ask N requests, then report and exit (default 10000, 0 runs until killed).\n");
+	printf("  --rate=N                Make N requests per second (default 1000, 0 as fast as they are answered).\n");
+	printf("  --outstanding=N         Keep at most N requests waiting (default 64).\n");
+	printf("  --timeout=MSEC          Deny requests nobody wrote to the query stream about for MSEC (default 10000).\n");
+	printf("  --domains=N             Spread requests over N domains (default 16).\n");
+	printf("  --paths=N               and N ACL lines per domain (default 256).\n");
+	printf("  --policy=FILE           Start with the domain policy in FILE.\n");
+	return 0;
+
+ok:
+	ccs_emu_domains = ccs_malloc(ccs_emu_domain_count *
+				     sizeof(const struct ccs_path_info *));
+	for (i = 0; i < ccs_emu_domain_count; i++) {
+		char name[64];
+		snprintf(name, sizeof(name), "<kernel> /usr/bin/emu%d", i);
+		ccs_emu_domains[i] = ccs_savename(name);
+	}
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+	ccs_emu_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	ccs_emu_tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	ccs_emu_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	setsockopt(ccs_emu_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (signal_fd == EOF || ccs_emu_tick_fd == EOF || ccs_emu_epoll_fd == EOF ||
+	    bind(ccs_emu_listen_fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+	    listen(ccs_emu_listen_fd, 16)) {
+		fprintf(stderr, "Can't listen on %s:%u\n", inet_ntoa(addr.sin_addr),
+			ntohs(addr.sin_port));
+		return 1;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &ccs_emu_listen_fd;
+	epoll_ctl(ccs_emu_epoll_fd, EPOLL_CTL_ADD, ccs_emu_listen_fd, &ev);
+	ev.data.ptr = &ccs_emu_tick_fd;
+	epoll_ctl(ccs_emu_epoll_fd, EPOLL_CTL_ADD, ccs_emu_tick_fd, &ev);
+	ev.data.ptr = &signal_fd;
+	epoll_ctl(ccs_emu_epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev);
+
+	//The clock starts with the first connection to the query stream
+	while (true) {
+		struct epoll_event events[16];
+		const int n = epoll_wait(ccs_emu_epoll_fd, events, 16, -1);
+		unsigned long long now;
+		if (n < 0 && errno != EINTR)
+			break;
+		for (i = 0; i < n; i++) {
+			void *ptr = events[i].data.ptr;
+			if (ptr == &ccs_emu_listen_fd) {
+				ccs_emu_accept();
+			} else if (ptr == &signal_fd) {
+				ccs_emu_report();
+				return 0;
+			} else if (ptr == &ccs_emu_tick_fd) {
+				unsigned long long expirations;
+				read(ccs_emu_tick_fd, &expirations, sizeof(expirations));
+			} else {
+				struct ccs_emu_client *client = ptr;
+				const int stream = client->stream;
+				if (!ccs_emu_read(client))
+					ccs_emu_close(client);
+				else if (stream != CCS_EMU_QUERY &&
+					 client->stream == CCS_EMU_QUERY &&
+					 !ccs_emu_start_us) {
+					struct itimerspec its;
+					memset(&its, 0, sizeof(its));
+					its.it_value.tv_nsec = CCS_EMU_TICK * 1000000;
+					its.it_interval = its.it_value;
+					timerfd_settime(ccs_emu_tick_fd, 0, &its, NULL);
+					ccs_emu_start_us = ccs_emu_usec_now();
+				}
+			}
+		}
+		if (!ccs_emu_start_us)
+			continue;
+		now = ccs_emu_usec_now();
+		ccs_emu_expire(now);
+		ccs_emu_generate(now);
+		if (ccs_emu_count && ccs_emu_next >= ccs_emu_count &&
+		    !ccs_emu_queries_len)
+			break;
+	}
+	ccs_emu_report();
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// End.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
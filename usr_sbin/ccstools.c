@@ -21,6 +21,7 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
  */
 #include "ccstools.h"
+#include <sys/mman.h>
 
 struct ccs_savename_entry {
 	struct ccs_savename_entry *next;
@@ -50,6 +51,8 @@ static _Bool ccs_hexadecimal(const char c);
 static _Bool ccs_alphabet_char(const char c);
 static u8 ccs_make_byte(const u8 c1, const u8 c2, const u8 c3);
 static int ccs_const_part_length(const char *filename);
+static char *ccs_freadline_network(FILE *fp);
+static void ccs_freadline_network_done(FILE *fp);
 static int ccs_domainname_compare(const void *a, const void *b);
 static int ccs_path_info_compare(const void *a, const void *b);
 static void ccs_sort_domain_policy(struct ccs_domain_policy *dp);
@@ -1210,6 +1213,667 @@ int ccs_parse_ip(const char *address, struct ccs_ip_address_entry *entry)
 	return -EINVAL;
 }
 
+/* Connections to ccs-editpolicy-agent kept open by ccs_agent_write(). */
+struct ccs_agent_conn {
+	const struct ccs_path_info *filename; /* NULL if the slot is free. */
+	int fd;
+};
+static struct ccs_agent_conn ccs_agent_pool[CCS_AGENT_POOL_SIZE];
+static int ccs_agent_pool_next = 0;
+/* Connecting is not tried again before this time after a failure. */
+static struct timespec ccs_agent_retry_at;
+static int ccs_agent_backoff = 0;
+
+/**
+ * ccs_agent_connect - Connect to ccs-editpolicy-agent program.
+ *
+ * @nonblock: True to return before the connection is established.
+ *
+ * Returns file descriptor on success, EOF otherwise.
+ *
+ * Requests are a few bytes waiting for an answer, so Nagle's algorithm is
+ * turned off.
+ */
+static int ccs_agent_connect(const _Bool nonblock)
+{
+	const int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC |
+			      (nonblock ? SOCK_NONBLOCK : 0), 0);
+	const int one = 1;
+	struct sockaddr_in addr;
+	if (fd == EOF)
+		return EOF;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = ccs_network_ip;
+	addr.sin_port = ccs_network_port;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) &&
+	    !(nonblock && errno == EINPROGRESS)) {
+		close(fd);
+		return EOF;
+	}
+	return fd;
+}
+
+/**
+ * ccs_agent_send - Send all of a buffer to ccs-editpolicy-agent program.
+ *
+ * @fd:   Connection to the agent.
+ * @data: Bytes to send.
+ * @len:  Length of @data.
+ *
+ * Returns true on success, false otherwise.
+ */
+static _Bool ccs_agent_send(const int fd, const char *data, int len)
+{
+	while (len > 0) {
+		const int done = send(fd, data, len, MSG_NOSIGNAL);
+		if (done == EOF) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data += done;
+		len -= done;
+	}
+	return true;
+}
+
+/**
+ * ccs_agent_alive - Check whether an idle pooled connection is still usable.
+ *
+ * @fd: Connection to the agent.
+ *
+ * Returns true if nothing arrived on @fd, false otherwise.
+ *
+ * Every reply the agent sends on a pooled connection is drained by
+ * ccs_agent_confirm(), so anything readable means the connection was closed
+ * or reset.
+ */
+static _Bool ccs_agent_alive(const int fd)
+{
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	return !poll(&pfd, 1, 0);
+}
+
+/**
+ * ccs_agent_open - Open a file through ccs-editpolicy-agent with backoff.
+ *
+ * @filename: String to send to remote ccs-editpolicy-agent program.
+ *
+ * Returns file descriptor on success, EOF otherwise.
+ *
+ * After a failure, further attempts fail at once until the backoff, doubled
+ * up to CCS_AGENT_BACKOFF_MAX msec by every failure, has passed.
+ */
+static int ccs_agent_open(const char *filename)
+{
+	struct timespec now;
+	char c;
+	int fd;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (ccs_agent_backoff &&
+	    (now.tv_sec < ccs_agent_retry_at.tv_sec ||
+	     (now.tv_sec == ccs_agent_retry_at.tv_sec &&
+	      now.tv_nsec < ccs_agent_retry_at.tv_nsec))) {
+		errno = EAGAIN;
+		return EOF;
+	}
+	fd = ccs_agent_connect(false);
+	if (fd != EOF &&
+	    (!ccs_agent_send(fd, filename, strlen(filename) + 1) ||
+	     read(fd, &c, 1) != 1 || c)) {
+		close(fd);
+		fd = EOF;
+	}
+	if (fd != EOF) {
+		ccs_agent_backoff = 0;
+		return fd;
+	}
+	ccs_agent_backoff = ccs_agent_backoff ? ccs_agent_backoff * 2 :
+		CCS_AGENT_BACKOFF_MIN;
+	if (ccs_agent_backoff > CCS_AGENT_BACKOFF_MAX)
+		ccs_agent_backoff = CCS_AGENT_BACKOFF_MAX;
+	ccs_agent_retry_at = now;
+	ccs_agent_retry_at.tv_sec += ccs_agent_backoff / 1000;
+	ccs_agent_retry_at.tv_nsec += (ccs_agent_backoff % 1000) * 1000000;
+	if (ccs_agent_retry_at.tv_nsec >= 1000000000) {
+		ccs_agent_retry_at.tv_sec++;
+		ccs_agent_retry_at.tv_nsec -= 1000000000;
+	}
+	return EOF;
+}
+
+/**
+ * ccs_agent_drop - Close a pooled connection.
+ *
+ * @conn: Pointer to "struct ccs_agent_conn".
+ *
+ * Returns nothing.
+ */
+static void ccs_agent_drop(struct ccs_agent_conn *conn)
+{
+	if (conn->filename)
+		close(conn->fd);
+	conn->filename = NULL;
+	conn->fd = EOF;
+}
+
+/**
+ * ccs_agent_confirm - Wait until ccs-editpolicy-agent handled everything sent.
+ *
+ * @fd: Connection to the agent.
+ *
+ * Returns true on success, false otherwise.
+ *
+ * Sends a NUL and drains the reply up to the NUL the agent ends it with. The
+ * agent handles its input in order, so once the reply arrived every byte sent
+ * before was written to the file.
+ */
+static _Bool ccs_agent_confirm(const int fd)
+{
+	char buffer[4096];
+	if (!ccs_agent_send(fd, "", 1))
+		return false;
+	while (true) {
+		const int len = recv(fd, buffer, sizeof(buffer), 0);
+		const char *end;
+		if (len == EOF && errno == EINTR)
+			continue;
+		if (len <= 0)
+			return false;
+		end = memchr(buffer, 0, len);
+		/* Anything after the NUL means the stream is out of step. */
+		if (end)
+			return end == buffer + len - 1;
+	}
+}
+
+/**
+ * ccs_agent_write - Write to a file through a pooled connection to ccs-editpolicy-agent.
+ *
+ * @filename: String to send to remote ccs-editpolicy-agent program.
+ * @data:     Bytes to write.
+ * @len:      Length of @data.
+ *
+ * Returns true on success, false otherwise.
+ *
+ * One connection per @filename is kept open across calls, up to
+ * CCS_AGENT_POOL_SIZE files, so a write costs no connection setup or
+ * handshake. A connection found closed before anything was sent is opened
+ * again, but @data is never sent twice: on any failure the connection is
+ * dropped, for part of @data may already have been written.
+ *
+ * Success means the agent confirmed the write by answering a NUL sent after
+ * @data, so whatever reads the file next sees it.
+ */
+_Bool ccs_agent_write(const char *filename, const char *data, const int len)
+{
+	const struct ccs_path_info *name = ccs_savename(filename);
+	struct ccs_agent_conn *conn = NULL;
+	int i;
+	for (i = 0; i < CCS_AGENT_POOL_SIZE; i++)
+		if (ccs_agent_pool[i].filename == name)
+			conn = &ccs_agent_pool[i];
+	if (!conn) {
+		for (i = 0; i < CCS_AGENT_POOL_SIZE; i++)
+			if (!ccs_agent_pool[i].filename)
+				conn = &ccs_agent_pool[i];
+		if (!conn) {
+			conn = &ccs_agent_pool[ccs_agent_pool_next++];
+			ccs_agent_pool_next %= CCS_AGENT_POOL_SIZE;
+			ccs_agent_drop(conn);
+		}
+	} else if (!ccs_agent_alive(conn->fd)) {
+		ccs_agent_drop(conn);
+	}
+	if (!conn->filename) {
+		conn->fd = ccs_agent_open(filename);
+		if (conn->fd == EOF)
+			return false;
+		conn->filename = name;
+	}
+	if (ccs_agent_send(conn->fd, data, len) && ccs_agent_confirm(conn->fd))
+		return true;
+	ccs_agent_drop(conn);
+	return false;
+}
+
+/**
+ * ccs_agent_close_all - Close the connections kept by ccs_agent_write().
+ *
+ * Returns nothing.
+ */
+void ccs_agent_close_all(void)
+{
+	int i;
+	for (i = 0; i < CCS_AGENT_POOL_SIZE; i++)
+		ccs_agent_drop(&ccs_agent_pool[i]);
+}
+
+/**
+ * ccs_batch_init - Start an empty batch of requests.
+ *
+ * @batch: Pointer to "struct ccs_agent_batch".
+ *
+ * Returns nothing.
+ */
+void ccs_batch_init(struct ccs_agent_batch *batch)
+{
+	memset(batch, 0, sizeof(*batch));
+}
+
+/**
+ * ccs_batch_free - Release a batch of requests and their replies.
+ *
+ * @batch: Pointer to "struct ccs_agent_batch".
+ *
+ * Returns nothing.
+ */
+void ccs_batch_free(struct ccs_agent_batch *batch)
+{
+	int i;
+	for (i = 0; i < batch->len; i++)
+		free(batch->list[i].data);
+	for (i = 0; i < batch->files_len; i++)
+		free(batch->files[i]);
+	free(batch->list);
+	free(batch->files);
+	ccs_batch_init(batch);
+}
+
+/**
+ * ccs_batch_file - Find the connection a file's requests go through.
+ *
+ * @batch:    Pointer to "struct ccs_agent_batch".
+ * @filename: File to read or write.
+ *
+ * Returns index in @batch->files .
+ */
+static int ccs_batch_file(struct ccs_agent_batch *batch, const char *filename)
+{
+	int i;
+	for (i = 0; i < batch->files_len; i++)
+		if (!strcmp(batch->files[i], filename))
+			return i;
+	batch->files = ccs_realloc(batch->files, (batch->files_len + 1) *
+				   sizeof(char *));
+	batch->files[batch->files_len] = ccs_strdup(filename);
+	return batch->files_len++;
+}
+
+/**
+ * ccs_batch_add - Append a request to a batch.
+ *
+ * @batch: Pointer to "struct ccs_agent_batch".
+ * @file:  Index in @batch->files .
+ *
+ * Returns pointer to the new "struct ccs_agent_request".
+ */
+static struct ccs_agent_request *ccs_batch_add(struct ccs_agent_batch *batch,
+					       const int file)
+{
+	struct ccs_agent_request *ptr;
+	batch->list = ccs_realloc(batch->list, (batch->len + 1) *
+				  sizeof(struct ccs_agent_request));
+	ptr = &batch->list[batch->len++];
+	memset(ptr, 0, sizeof(*ptr));
+	ptr->file = file;
+	return ptr;
+}
+
+/**
+ * ccs_batch_write - Queue a write to a file in a batch.
+ *
+ * @batch:    Pointer to "struct ccs_agent_batch".
+ * @filename: File to write, as for ccs_open_write().
+ * @data:     Bytes to write.
+ * @len:      Length of @data.
+ *
+ * Returns nothing.
+ *
+ * Writes following each other on the same file are sent as one.
+ */
+void ccs_batch_write(struct ccs_agent_batch *batch, const char *filename,
+		     const char *data, const int len)
+{
+	const int file = ccs_batch_file(batch, filename);
+	struct ccs_agent_request *ptr = NULL;
+	int i;
+	for (i = batch->len - 1; i >= 0; i--)
+		if (batch->list[i].file == file) {
+			if (!batch->list[i].is_read)
+				ptr = &batch->list[i];
+			break;
+		}
+	if (!ptr)
+		ptr = ccs_batch_add(batch, file);
+	ptr->data = ccs_realloc(ptr->data, ptr->len + len);
+	memcpy(ptr->data + ptr->len, data, len);
+	ptr->len += len;
+}
+
+/**
+ * ccs_batch_read - Queue a read of a file in a batch.
+ *
+ * @batch:    Pointer to "struct ccs_agent_batch".
+ * @filename: File to read, as for ccs_open_read().
+ *
+ * Returns index to pass to ccs_batch_reply().
+ *
+ * The file is read after the writes to it queued before.
+ */
+int ccs_batch_read(struct ccs_agent_batch *batch, const char *filename)
+{
+	ccs_batch_add(batch, ccs_batch_file(batch, filename))->is_read = true;
+	return batch->len - 1;
+}
+
+/**
+ * ccs_batch_reply - Get what a read queued in a batch returned.
+ *
+ * @batch: Pointer to "struct ccs_agent_batch".
+ * @index: Return value of ccs_batch_read().
+ * @len:   Set to the length of the reply. Maybe NULL.
+ *
+ * Returns the NUL-terminated contents of the file if the read succeeded,
+ * NULL otherwise.
+ */
+const char *ccs_batch_reply(const struct ccs_agent_batch *batch,
+			    const int index, int *len)
+{
+	const struct ccs_agent_request *ptr = &batch->list[index];
+	if (!ptr->is_read || !ptr->done)
+		return NULL;
+	if (len)
+		*len = ptr->len;
+	return ptr->data ? ptr->data : "";
+}
+
+/**
+ * ccs_batch_append - Append bytes to what a read returned.
+ *
+ * @ptr:  Pointer to "struct ccs_agent_request".
+ * @data: Bytes read.
+ * @len:  Length of @data.
+ *
+ * Returns nothing.
+ *
+ * The reply is kept NUL-terminated.
+ */
+static void ccs_batch_append(struct ccs_agent_request *ptr, const char *data,
+			     const int len)
+{
+	ptr->data = ccs_realloc(ptr->data, ptr->len + len + 1);
+	memcpy(ptr->data + ptr->len, data, len);
+	ptr->len += len;
+	ptr->data[ptr->len] = '\0';
+}
+
+/**
+ * ccs_batch_run_local - Run a batch on local files.
+ *
+ * @batch: Pointer to "struct ccs_agent_batch".
+ *
+ * Returns nothing.
+ *
+ * Each file is opened once, its requests are run in the order queued.
+ */
+static void ccs_batch_run_local(struct ccs_agent_batch *batch)
+{
+	int file;
+	for (file = 0; file < batch->files_len; file++) {
+		_Bool reads = false;
+		_Bool writes = false;
+		int fd;
+		int i;
+		for (i = 0; i < batch->len; i++)
+			if (batch->list[i].file == file) {
+				if (batch->list[i].is_read)
+					reads = true;
+				else
+					writes = true;
+			}
+		fd = open(batch->files[file], reads && writes ? O_RDWR :
+			  reads ? O_RDONLY : O_WRONLY);
+		if (fd == EOF)
+			continue;
+		for (i = 0; i < batch->len; i++) {
+			struct ccs_agent_request *ptr = &batch->list[i];
+			if (ptr->file != file)
+				continue;
+			if (ptr->is_read) {
+				char buf[4096];
+				int len;
+				ccs_batch_append(ptr, buf, 0);
+				while ((len = read(fd, buf, sizeof(buf))) > 0)
+					ccs_batch_append(ptr, buf, len);
+				ptr->done = !len;
+			} else {
+				ptr->done = write(fd, ptr->data, ptr->len) ==
+					ptr->len;
+			}
+			if (!ptr->done)
+				break;
+		}
+		close(fd);
+	}
+}
+
+/* One connection to ccs-editpolicy-agent used by ccs_batch_run(). */
+struct ccs_batch_conn {
+	int fd;
+	char *out;          /* Name, writes and a NUL for each read      */
+	int out_len;
+	int out_pos;
+	int reading;        /* Request the next reply belongs to, EOF if
+			     * none, -2 before the handshake            */
+	_Bool sent;
+	_Bool closed;
+};
+
+/**
+ * ccs_batch_next_read - Find the next read queued for a file.
+ *
+ * @batch: Pointer to "struct ccs_agent_batch".
+ * @file:  Index in @batch->files .
+ * @from:  Index in @batch->list to search from.
+ *
+ * Returns index in @batch->list, EOF if none.
+ */
+static int ccs_batch_next_read(const struct ccs_agent_batch *batch,
+			       const int file, int from)
+{
+	for (; from < batch->len; from++)
+		if (batch->list[from].file == file &&
+		    batch->list[from].is_read)
+			return from;
+	return EOF;
+}
+
+/**
+ * ccs_batch_receive - Handle bytes the agent sent for a file.
+ *
+ * @batch: Pointer to "struct ccs_agent_batch".
+ * @file:  Index in @batch->files .
+ * @conn:  Pointer to "struct ccs_batch_conn".
+ * @buf:   Bytes received.
+ * @len:   Length of @buf.
+ *
+ * Returns false if the agent refused the file, true otherwise.
+ *
+ * The handshake NUL comes first, then each read's reply ended by a NUL.
+ */
+static _Bool ccs_batch_receive(struct ccs_agent_batch *batch, const int file,
+			       struct ccs_batch_conn *conn, const char *buf,
+			       int len)
+{
+	while (len > 0) {
+		const char *cp;
+		int part;
+		if (conn->reading == -2) {
+			if (*buf)
+				return false;
+			conn->reading = ccs_batch_next_read(batch, file, 0);
+			buf++;
+			len--;
+			continue;
+		}
+		if (conn->reading == EOF)
+			return true;
+		cp = memchr(buf, '\0', len);
+		part = cp ? cp - buf : len;
+		ccs_batch_append(&batch->list[conn->reading], buf, part);
+		if (!cp)
+			break;
+		batch->list[conn->reading].done = true;
+		conn->reading = ccs_batch_next_read(batch, file,
+						    conn->reading + 1);
+		buf += part + 1;
+		len -= part + 1;
+	}
+	return true;
+}
+
+/**
+ * ccs_batch_run - Run the requests queued in a batch.
+ *
+ * @batch: Pointer to "struct ccs_agent_batch".
+ *
+ * Returns true if every request succeeded, false otherwise.
+ *
+ * In network mode, ccs-editpolicy-agent opens one file per connection, so
+ * the requests are grouped by file. All the connections are opened at once,
+ * and each one is sent its file's name, writes and reads back-to-back
+ * without waiting for the handshake, then its sending side is shut down.
+ * The replies are split at the NULs as they arrive, and the agent closing
+ * the connection confirms the writes. A batch therefore takes about one
+ * round trip, however many requests it holds. Requests for one file run in
+ * the order queued. Requests for different files run concurrently.
+ *
+ * If none of the connections makes progress for CCS_AGENT_BATCH_TIMEOUT
+ * msec, the remaining ones are given up and the batch fails with errno set
+ * to ETIMEDOUT.
+ */
+_Bool ccs_batch_run(struct ccs_agent_batch *batch)
+{
+	struct ccs_batch_conn *conns;
+	struct pollfd *pfds;
+	_Bool timed_out = false;
+	int file;
+	int i;
+	if (!ccs_network_mode) {
+		ccs_batch_run_local(batch);
+		goto out;
+	}
+	conns = ccs_malloc(batch->files_len * sizeof(*conns));
+	pfds = ccs_malloc(batch->files_len * sizeof(*pfds));
+	memset(conns, 0, batch->files_len * sizeof(*conns));
+	for (file = 0; file < batch->files_len; file++) {
+		struct ccs_batch_conn *conn = &conns[file];
+		const int len = strlen(batch->files[file]) + 1;
+		conn->fd = ccs_agent_connect(true);
+		conn->reading = -2;
+		conn->closed = conn->fd == EOF;
+		conn->out = ccs_malloc(len);
+		memcpy(conn->out, batch->files[file], len);
+		conn->out_len = len;
+		for (i = 0; i < batch->len; i++) {
+			const struct ccs_agent_request *ptr = &batch->list[i];
+			const int add = ptr->is_read ? 1 : ptr->len;
+			if (ptr->file != file)
+				continue;
+			conn->out = ccs_realloc(conn->out, conn->out_len + add);
+			if (ptr->is_read)
+				conn->out[conn->out_len] = '\0';
+			else
+				memcpy(conn->out + conn->out_len, ptr->data,
+				       ptr->len);
+			conn->out_len += add;
+		}
+	}
+	while (true) {
+		int n = 0;
+		for (file = 0; file < batch->files_len; file++) {
+			struct ccs_batch_conn *conn = &conns[file];
+			pfds[file].fd = conn->closed ? -1 : conn->fd;
+			pfds[file].events = conn->sent ? POLLIN :
+				POLLIN | POLLOUT;
+			pfds[file].revents = 0;
+			if (!conn->closed)
+				n++;
+		}
+		if (!n)
+			break;
+		n = poll(pfds, batch->files_len, CCS_AGENT_BATCH_TIMEOUT);
+		if (n == EOF) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (!n) {
+			for (file = 0; file < batch->files_len; file++)
+				conns[file].closed = true;
+			timed_out = true;
+			break;
+		}
+		for (file = 0; file < batch->files_len; file++) {
+			struct ccs_batch_conn *conn = &conns[file];
+			char buf[65536];
+			int len;
+			if (conn->closed || !pfds[file].revents)
+				continue;
+			if (!conn->sent && (pfds[file].revents & POLLOUT)) {
+				len = send(conn->fd, conn->out + conn->out_pos,
+					   conn->out_len - conn->out_pos,
+					   MSG_NOSIGNAL);
+				if (len == EOF && errno != EINTR &&
+				    errno != EAGAIN) {
+					conn->closed = true;
+					continue;
+				}
+				if (len > 0)
+					conn->out_pos += len;
+				if (conn->out_pos == conn->out_len) {
+					shutdown(conn->fd, SHUT_WR);
+					conn->sent = true;
+				}
+			}
+			if (!(pfds[file].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+			len = recv(conn->fd, buf, sizeof(buf), 0);
+			if (len == EOF && (errno == EINTR || errno == EAGAIN))
+				continue;
+			if (len <= 0) {
+				/* Writes are done once the agent hung up. */
+				if (!len && conn->sent && conn->reading != -2)
+					for (i = 0; i < batch->len; i++)
+						if (batch->list[i].file == file &&
+						    !batch->list[i].is_read)
+							batch->list[i].done = true;
+				conn->closed = true;
+			} else if (!ccs_batch_receive(batch, file, conn, buf,
+						      len)) {
+				conn->closed = true;
+			}
+		}
+	}
+	for (file = 0; file < batch->files_len; file++) {
+		if (conns[file].fd != EOF)
+			close(conns[file].fd);
+		free(conns[file].out);
+	}
+	free(conns);
+	free(pfds);
+	if (timed_out)
+		errno = ETIMEDOUT;
+out:
+	for (i = 0; i < batch->len; i++)
+		if (!batch->list[i].done)
+			return false;
+	return true;
+}
+
 /**
  * ccs_open_stream - Establish IP connection.
  *
@@ -1219,22 +1883,112 @@ int ccs_parse_ip(const char *address, struct ccs_ip_address_entry *entry)
  */
 int ccs_open_stream(const char *filename)
 {
-	const int fd = socket(AF_INET, SOCK_STREAM, 0);
-	struct sockaddr_in addr;
+	const int fd = ccs_agent_connect(false);
 	char c;
 	int len = strlen(filename) + 1;
-	memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_addr.s_addr = ccs_network_ip;
-	addr.sin_port = ccs_network_port;
-	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
-	    write(fd, filename, len) != len || read(fd, &c, 1) != 1 || c) {
+	if (fd == EOF)
+		return EOF;
+	if (write(fd, filename, len) != len || read(fd, &c, 1) != 1 || c) {
 		close(fd);
 		return EOF;
 	}
 	return fd;
 }
 
+/**
+ * ccs_reader_init - Start reading a stream in chunks.
+ *
+ * @reader: Pointer to "struct ccs_reader".
+ * @fd:     File descriptor to read from.
+ *
+ * Returns nothing.
+ */
+void ccs_reader_init(struct ccs_reader *reader, const int fd)
+{
+	memset(reader, 0, sizeof(*reader));
+	reader->fd = fd;
+}
+
+/**
+ * ccs_reader_free - Release the buffer of a "struct ccs_reader".
+ *
+ * @reader: Pointer to "struct ccs_reader".
+ *
+ * Returns nothing.
+ *
+ * The file descriptor is not closed.
+ */
+void ccs_reader_free(struct ccs_reader *reader)
+{
+	free(reader->buf);
+	ccs_reader_init(reader, EOF);
+}
+
+/**
+ * ccs_reader_next - Hand out the next NUL or newline terminated part of a stream.
+ *
+ * @reader: Pointer to "struct ccs_reader".
+ * @lines:  True if a newline ends a part too, false if only NUL does.
+ * @len:    Set to the length of the part. Maybe NULL.
+ * @delim:  Set to the byte which ended the part. Maybe NULL.
+ *
+ * Returns pointer to the part, NUL-terminated in place of its delimiter, on
+ * success, NULL on EOF or error.
+ *
+ * The stream is read CCS_READER_CHUNK bytes at a time and searched with
+ * memchr(). The returned part stays valid until the next call.
+ */
+char *ccs_reader_next(struct ccs_reader *reader, const _Bool lines,
+		      int *len, char *delim)
+{
+	int scanned = reader->start;
+	while (true) {
+		char *start = reader->buf + reader->start;
+		char *end = reader->buf + reader->end;
+		char *cp = memchr(reader->buf + scanned, '\0', end -
+				  (reader->buf + scanned));
+		if (lines) {
+			char *nl = memchr(reader->buf + scanned, '\n',
+					  (cp ? cp : end) -
+					  (reader->buf + scanned));
+			if (nl)
+				cp = nl;
+		}
+		if (cp) {
+			if (len)
+				*len = cp - start;
+			if (delim)
+				*delim = *cp;
+			*cp = '\0';
+			reader->start = cp + 1 - reader->buf;
+			return start;
+		}
+		scanned = reader->end;
+		/* Make room, moving the incomplete part to the front. */
+		if (reader->start) {
+			memmove(reader->buf, start, reader->end - reader->start);
+			scanned -= reader->start;
+			reader->end -= reader->start;
+			reader->start = 0;
+		}
+		if (reader->size - reader->end < CCS_READER_CHUNK) {
+			reader->size = reader->end + CCS_READER_CHUNK;
+			reader->buf = ccs_realloc(reader->buf, reader->size);
+		}
+		while (true) {
+			const int done = read(reader->fd, reader->buf +
+					      reader->end, reader->size -
+					      reader->end);
+			if (done > 0) {
+				reader->end += done;
+				break;
+			}
+			if (!done || errno != EINTR)
+				return NULL;
+		}
+	}
+}
+
 /**
  * ccs_find_domain - Find a domain by name and other attributes.
  *
@@ -1495,7 +2249,7 @@ void ccs_read_process_list(_Bool show_all)
 			ccs_add_process_entry(line, ppid, name);
 		}
 		ccs_put();
-		fclose(fp);
+		ccs_close_read(fp);
 	} else {
 		static const int line_len = 8192;
 		char *line;
@@ -1567,17 +2321,10 @@ void ccs_read_process_list(_Bool show_all)
 FILE *ccs_open_write(const char *filename)
 {
 	if (ccs_network_mode) {
-		const int fd = socket(AF_INET, SOCK_STREAM, 0);
-		struct sockaddr_in addr;
+		const int fd = ccs_agent_connect(false);
 		FILE *fp;
-		memset(&addr, 0, sizeof(addr));
-		addr.sin_family = AF_INET;
-		addr.sin_addr.s_addr = ccs_network_ip;
-		addr.sin_port = ccs_network_port;
-		if (connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
-			close(fd);
+		if (fd == EOF)
 			return NULL;
-		}
 		fp = fdopen(fd, "r+");
 		/* setbuf(fp, NULL); */
 		fprintf(fp, "%s", filename);
@@ -1603,6 +2350,7 @@ FILE *ccs_open_write(const char *filename)
 _Bool ccs_close_write(FILE *fp)
 {
 	_Bool result = true;
+	ccs_freadline_network_done(fp);
 	if (ccs_network_mode) {
 		if (fputc(0, fp) == EOF)
 			result = false;
@@ -1617,6 +2365,45 @@ _Bool ccs_close_write(FILE *fp)
 }
 
 
+/**
+ * ccs_set_profile - Change the profile a domain uses.
+ *
+ * @domainname: Name of domain to change.
+ * @profile:    Profile number to use.
+ *
+ * Returns true on success, false otherwise.
+ *
+ * Writes "use_profile" to domain policy, through ccs_agent_write() if using
+ * network mode.
+ */
+_Bool ccs_set_profile(const char *domainname, const unsigned int profile)
+{
+	FILE *fp;
+	_Bool result = true;
+	if (!ccs_correct_domain(domainname) || profile > 255) {
+		errno = EINVAL;
+		return false;
+	}
+	if (ccs_network_mode) {
+		char *line = ccs_malloc(strlen(domainname) + 40);
+		const int len = sprintf(line, "select domain=%s\nuse_profile %u\n",
+					domainname, profile);
+		result = ccs_agent_write(CCS_PROC_POLICY_DOMAIN_POLICY, line,
+					 len);
+		free(line);
+		return result;
+	}
+	fp = ccs_open_write(CCS_PROC_POLICY_DOMAIN_POLICY);
+	if (!fp)
+		return false;
+	if (fprintf(fp, "select domain=%s\nuse_profile %u\n", domainname,
+		    profile) < 0)
+		result = false;
+	if (!ccs_close_write(fp))
+		result = false;
+	return result;
+}
+
 /**
  * ccs_open_read - Open a file for reading.
  *
@@ -1639,6 +2426,50 @@ FILE *ccs_open_read(const char *filename)
 	}
 }
 
+/**
+ * ccs_close_read - Close stream opened by ccs_open_read().
+ *
+ * @fp: Pointer to "FILE".
+ *
+ * Returns true on success, false otherwise.
+ *
+ * Whatever ccs_freadline() buffered for @fp is dropped with it.
+ */
+_Bool ccs_close_read(FILE *fp)
+{
+	ccs_freadline_network_done(fp);
+	return fclose(fp) != EOF;
+}
+
+/**
+ * ccs_copy_proc - Copy policy from /proc/ccs/ to a stream.
+ *
+ * @proc_fp: Pointer to "FILE" opened by ccs_open_read().
+ * @file_fp: Pointer to "FILE" to write to.
+ * @hash:    Pointer to FNV-1a hash of the copied bytes. Maybe NULL.
+ *
+ * Returns true on success, false otherwise.
+ */
+static _Bool ccs_copy_proc(FILE *proc_fp, FILE *file_fp,
+			   unsigned long long *hash)
+{
+	unsigned long long h = 14695981039346656037ULL;
+	_Bool result = true;
+	while (true) {
+		const int c = getc(proc_fp);
+		if (ccs_network_mode && !c)
+			break;
+		if (c == EOF)
+			break;
+		h = (h ^ (u8) c) * 1099511628211ULL;
+		if (putc(c, file_fp) == EOF)
+			result = false;
+	}
+	if (hash)
+		*hash = h;
+	return result;
+}
+
 /**
  * ccs_move_proc_to_file - Save /proc/ccs/ to /etc/ccs/ .
  *
@@ -1659,25 +2490,280 @@ _Bool ccs_move_proc_to_file(const char *src, const char *dest)
 	file_fp = dest ? fopen(dest, "w") : stdout;
 	if (!file_fp) {
 		fprintf(stderr, "Can't open %s for writing.\n", dest);
-		fclose(proc_fp);
+		ccs_close_read(proc_fp);
 		return false;
 	}
-	while (true) {
-		const int c = fgetc(proc_fp);
-		if (ccs_network_mode && !c)
-			break;
-		if (c == EOF)
-			break;
-		if (fputc(c, file_fp) == EOF)
-			result = false;
-	}
-	fclose(proc_fp);
+	result = ccs_copy_proc(proc_fp, file_fp, NULL);
+	ccs_close_read(proc_fp);
 	if (file_fp != stdout)
 		if (fclose(file_fp) == EOF)
 			result = false;
 	return result;
 }
 
+/* Hash of what was last saved to each file by ccs_save_proc_to_file(). */
+static struct ccs_saved_file {
+	char *filename;
+	unsigned long long hash;
+} *ccs_saved_file_list = NULL;
+static int ccs_saved_file_list_len = 0;
+
+/**
+ * ccs_saved_file - Find the last saved snapshot of a file.
+ *
+ * @dest: Filename.
+ *
+ * Returns pointer to "struct ccs_saved_file".
+ *
+ * A file not saved by this process yet is hashed once.
+ */
+static struct ccs_saved_file *ccs_saved_file(const char *dest)
+{
+	struct ccs_saved_file *ptr;
+	FILE *fp;
+	int i;
+	for (i = 0; i < ccs_saved_file_list_len; i++)
+		if (!strcmp(ccs_saved_file_list[i].filename, dest))
+			return &ccs_saved_file_list[i];
+	ccs_saved_file_list = ccs_realloc(ccs_saved_file_list,
+					  (ccs_saved_file_list_len + 1) *
+					  sizeof(struct ccs_saved_file));
+	ptr = &ccs_saved_file_list[ccs_saved_file_list_len++];
+	ptr->filename = ccs_strdup(dest);
+	ptr->hash = 0;
+	fp = fopen(dest, "r");
+	if (fp) {
+		unsigned long long h = 14695981039346656037ULL;
+		int c;
+		while ((c = getc(fp)) != EOF)
+			h = (h ^ (u8) c) * 1099511628211ULL;
+		fclose(fp);
+		ptr->hash = h;
+	}
+	return ptr;
+}
+
+/**
+ * ccs_save_stream_to_file - Save policy read from a stream to /etc/ccs/ atomically.
+ *
+ * @proc_fp: Pointer to "FILE" to read the policy from. Closed on return.
+ * @dest:    Filename to save to.
+ *
+ * Returns 1 if @dest was replaced, 0 if the policy did not change since it
+ * was last saved, -1 on error.
+ *
+ * The policy is copied to "@dest.tmp" once while hashing it. Unless the hash
+ * matches the last saved snapshot, the copy is fsync()ed and renamed over
+ * @dest, so @dest always holds either the old or the new policy.
+ */
+static int ccs_save_stream_to_file(FILE *proc_fp, const char *dest)
+{
+	struct ccs_saved_file *saved = ccs_saved_file(dest);
+	char *tmp = ccs_malloc(strlen(dest) + 5);
+	FILE *file_fp;
+	unsigned long long hash;
+	_Bool result;
+	sprintf(tmp, "%s.tmp", dest);
+	file_fp = fopen(tmp, "w");
+	if (!file_fp) {
+		fprintf(stderr, "Can't open %s for writing.\n", tmp);
+		ccs_close_read(proc_fp);
+		free(tmp);
+		return -1;
+	}
+	result = ccs_copy_proc(proc_fp, file_fp, &hash);
+	ccs_close_read(proc_fp);
+	if (result && hash == saved->hash) {
+		fclose(file_fp);
+		unlink(tmp);
+		free(tmp);
+		return 0;
+	}
+	if (fflush(file_fp) == EOF || fsync(fileno(file_fp)))
+		result = false;
+	if (fclose(file_fp) == EOF)
+		result = false;
+	if (!result || rename(tmp, dest)) {
+		fprintf(stderr, "Can't save %s .\n", dest);
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	saved->hash = hash;
+	return 1;
+}
+
+/**
+ * ccs_save_proc_to_file - Save /proc/ccs/ to /etc/ccs/ atomically.
+ *
+ * @src:  Filename to save from.
+ * @dest: Filename to save to.
+ *
+ * Returns 1 if @dest was replaced, 0 if the policy did not change since it
+ * was last saved, -1 on error.
+ */
+int ccs_save_proc_to_file(const char *src, const char *dest)
+{
+	FILE *proc_fp = ccs_open_read(src);
+	if (!proc_fp) {
+		fprintf(stderr, "Can't open %s for reading.\n", src);
+		return -1;
+	}
+	return ccs_save_stream_to_file(proc_fp, dest);
+}
+
+/**
+ * ccs_save_policy - Save all policies from /proc/ccs/ to a directory.
+ *
+ * @dir: Directory to save to, with trailing '/'.
+ *
+ * Returns number of files replaced, -1 on error.
+ *
+ * Files are named the way ccs-loadpolicy expects them. Unchanged policies
+ * are skipped, see ccs_save_proc_to_file(). In network mode all of them are
+ * fetched with one ccs_batch_run() first.
+ */
+int ccs_save_policy(const char *dir)
+{
+	static const char * const files[][2] = {
+		{ CCS_PROC_POLICY_PROFILE, "profile.conf" },
+		{ CCS_PROC_POLICY_MANAGER, "manager.conf" },
+		{ CCS_PROC_POLICY_EXCEPTION_POLICY, "exception_policy.conf" },
+		{ CCS_PROC_POLICY_DOMAIN_POLICY, "domain_policy.conf" },
+		{ CCS_PROC_POLICY_STAT, "stat.conf" },
+	};
+	struct ccs_agent_batch batch;
+	int count = 0;
+	int i;
+	int fd;
+	ccs_batch_init(&batch);
+	if (ccs_network_mode) {
+		for (i = 0; i < sizeof(files) / sizeof(files[0]); i++)
+			ccs_batch_read(&batch, files[i][0]);
+		ccs_batch_run(&batch);
+	}
+	for (i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		char *dest = ccs_malloc(strlen(dir) + strlen(files[i][1]) + 1);
+		int ret = -1;
+		sprintf(dest, "%s%s", dir, files[i][1]);
+		if (ccs_network_mode) {
+			int len;
+			const char *reply = ccs_batch_reply(&batch, i, &len);
+			FILE *proc_fp = reply && len ?
+				fmemopen((void *) reply, len, "r") :
+				reply ? fopen("/dev/null", "r") : NULL;
+			if (proc_fp)
+				ret = ccs_save_stream_to_file(proc_fp, dest);
+			else
+				fprintf(stderr, "Can't read %s .\n",
+					files[i][0]);
+		} else {
+			ret = ccs_save_proc_to_file(files[i][0], dest);
+		}
+		free(dest);
+		if (ret < 0) {
+			ccs_batch_free(&batch);
+			return -1;
+		}
+		count += ret;
+	}
+	ccs_batch_free(&batch);
+	/* Make the renames durable. */
+	if (count) {
+		fd = open(dir, O_RDONLY | O_DIRECTORY);
+		if (fd != EOF) {
+			fsync(fd);
+			close(fd);
+		}
+	}
+	return count;
+}
+
+/**
+ * ccs_journal_scan - Walk the decisions in a journal written by ccs-firewall.
+ *
+ * @filename: Journal to read.
+ * @func:     Called for each decision in the order written. Stops the scan by
+ *            returning false.
+ * @data:     Passed to @func.
+ *
+ * Returns number of decisions passed to @func, -1 on error.
+ *
+ * The file is mapped and walked in place, @func gets pointers into the
+ * mapping which are valid until it returns. A record cut short by a crash
+ * ends the scan.
+ */
+int ccs_journal_scan(const char *filename,
+		     _Bool (*func) (const struct ccs_journal_entry *, void *),
+		     void *data)
+{
+	const char **names = NULL;
+	u32 names_len = 0;
+	struct stat buf;
+	const char *map;
+	size_t pos = sizeof(CCS_JOURNAL_MAGIC) - 1;
+	int count = 0;
+	const int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd == EOF)
+		return -1;
+	if (fstat(fd, &buf) || (buf.st_size && buf.st_size < pos)) {
+		close(fd);
+		return -1;
+	}
+	if (!buf.st_size) {
+		close(fd);
+		return 0;
+	}
+	map = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	if (memcmp(map, CCS_JOURNAL_MAGIC, pos)) {
+		munmap((void *) map, buf.st_size);
+		return -1;
+	}
+	madvise((void *) map, buf.st_size, MADV_SEQUENTIAL);
+	while (pos + sizeof(struct ccs_journal_header) <= buf.st_size) {
+		const struct ccs_journal_header *head =
+			(const struct ccs_journal_header *) (map + pos);
+		if (head->length < sizeof(*head) || head->length & 7 ||
+		    head->length > buf.st_size - pos)
+			break;
+		if (head->type == CCS_JOURNAL_NAME) {
+			const struct ccs_journal_name *ptr =
+				(const struct ccs_journal_name *) head;
+			if (head->length <= sizeof(*ptr) || !ptr->id ||
+			    !memchr(ptr->name, '\0', head->length - sizeof(*ptr)))
+				break;
+			if (ptr->id >= names_len) {
+				const u32 len = ptr->id * 2;
+				names = ccs_realloc(names, len * sizeof(char *));
+				memset(names + names_len, 0,
+				       (len - names_len) * sizeof(char *));
+				names_len = len;
+			}
+			names[ptr->id] = ptr->name;
+		} else if (head->type == CCS_JOURNAL_DECISION) {
+			struct ccs_journal_entry entry;
+			if (head->length < sizeof(*entry.record))
+				break;
+			entry.record = (const struct ccs_journal_decision *) head;
+			entry.domainname = entry.record->domain < names_len ?
+				names[entry.record->domain] : NULL;
+			entry.acl = entry.record->acl < names_len ?
+				names[entry.record->acl] : NULL;
+			count++;
+			if (!func(&entry, data))
+				break;
+		}
+		pos += head->length;
+	}
+	free(names);
+	munmap((void *) map, buf.st_size);
+	return count;
+}
+
 /**
  * ccs_clear_domain_policy - Clean up domain policy.
  *
@@ -1804,7 +2890,7 @@ void ccs_read_domain_policy(struct ccs_domain_policy *dp, const char *filename)
 	ccs_handle_domain_policy(dp, fp, true);
 	ccs_put();
 	if (fp != stdin)
-		fclose(fp);
+		ccs_close_read(fp);
 	ccs_sort_domain_policy(dp);
 }
 
@@ -2083,6 +3169,79 @@ char *ccs_shprintf(const char *fmt, ...)
 	}
 }
 
+/* Agent stream read by ccs_freadline_network(), NULL if none. */
+static FILE *ccs_agent_read_fp = NULL;
+static struct ccs_reader ccs_agent_reader = { EOF, NULL, 0, 0, 0 };
+
+/**
+ * ccs_agent_stream - Check whether a stream is a connection to ccs-editpolicy-agent.
+ *
+ * @fp: Pointer to "FILE".
+ *
+ * Returns true if @fp is being read by ccs_freadline_network() or is a
+ * socket while no other stream is, false otherwise.
+ *
+ * Local files, such as rules read in network mode, keep using stdio.
+ */
+static _Bool ccs_agent_stream(FILE *fp)
+{
+	struct stat buf;
+	if (fp == ccs_agent_read_fp)
+		return true;
+	return !ccs_agent_read_fp && !fstat(fileno(fp), &buf) &&
+		S_ISSOCK(buf.st_mode);
+}
+
+/**
+ * ccs_freadline_network - Read a line sent by ccs-editpolicy-agent program.
+ *
+ * @fp: Pointer to "FILE" opened by ccs_open_read() or ccs_open_write().
+ *
+ * Returns pointer to the line on success, NULL at the NUL which ends the
+ * response or on error.
+ *
+ * The response is read from the descriptor of @fp through a
+ * "struct ccs_reader" instead of one fgetc() per byte. Nothing is buffered in
+ * @fp after the handshake, for the agent sends nothing more until asked. The
+ * reader belongs to @fp until the end of the response or until @fp is closed
+ * by ccs_close_read() or ccs_close_write(), whichever comes first.
+ */
+static char *ccs_freadline_network(FILE *fp)
+{
+	char delim;
+	char *line;
+	if (fp != ccs_agent_read_fp) {
+		ccs_reader_init(&ccs_agent_reader, fileno(fp));
+		ccs_agent_read_fp = fp;
+	}
+	line = ccs_reader_next(&ccs_agent_reader, true, NULL, &delim);
+	if (!line || !delim) {
+		ccs_freadline_network_done(fp);
+		return NULL;
+	}
+	if (!ccs_freadline_raw)
+		ccs_normalize_line(line);
+	return line;
+}
+
+/**
+ * ccs_freadline_network_done - Drop the reader of an agent stream.
+ *
+ * @fp: Pointer to "FILE".
+ *
+ * Returns nothing.
+ *
+ * Does nothing unless @fp is being read by ccs_freadline_network(), so bytes
+ * left over in the reader never reach a later stream.
+ */
+static void ccs_freadline_network_done(FILE *fp)
+{
+	if (fp != ccs_agent_read_fp)
+		return;
+	ccs_reader_free(&ccs_agent_reader);
+	ccs_agent_read_fp = NULL;
+}
+
 /**
  * ccs_freadline - Read a line from file to dynamically allocated buffer.
  *
@@ -2096,6 +3255,8 @@ char *ccs_freadline(FILE *fp)
 {
 	static char *policy = NULL;
 	int pos = 0;
+	if (ccs_network_mode && ccs_agent_stream(fp))
+		return ccs_freadline_network(fp);
 	while (true) {
 		static int max_policy_len = 0;
 		const int c = fgetc(fp);
@@ -2258,9 +3419,9 @@ _Bool ccs_check_remote_host(void)
 			(u8) (ip >> 24), (u8) (ip >> 16),
 			(u8) (ip >> 8), (u8) ip, ntohs(ccs_network_port));
 		if (fp)
-			fclose(fp);
+			ccs_close_read(fp);
 		return false;
 	}
-	fclose(fp);
+	ccs_close_read(fp);
 	return true;
 }
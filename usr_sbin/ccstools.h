@@ -42,11 +42,13 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <poll.h>
+#include <netinet/tcp.h>
 
 #define s8 __s8
 #define u8 __u8
 #define u16 __u16
 #define u32 __u32
+#define u64 __u64
 #define true  1
 #define false 0
 
@@ -62,6 +64,40 @@
 #define CCS_PROC_POLICY_PROFILE          "/proc/ccs/profile"
 #define CCS_PROC_POLICY_QUERY            "/proc/ccs/query"
 
+#define CCS_DISK_POLICY_DIR              "/etc/ccs/policy/current/"
+
+/* Connections kept open by ccs_agent_write(), one per file. */
+#define CCS_AGENT_POOL_SIZE              4
+/* msec not connecting after a failure, doubled by each failure up to max. */
+#define CCS_AGENT_BACKOFF_MIN            100
+#define CCS_AGENT_BACKOFF_MAX            10000
+/* msec ccs_batch_run() waits for a stalled agent before failing the batch. */
+#define CCS_AGENT_BATCH_TIMEOUT          10000
+
+/* Bytes read at a time by ccs_reader_next(). */
+#define CCS_READER_CHUNK                 65536
+
+/* Decision journal written by ccs-firewall, read by ccs_journal_scan(). */
+#define CCS_JOURNAL_MAGIC                "CCSJRN01"
+
+enum ccs_journal_record_type {
+	CCS_JOURNAL_NAME = 1,
+	CCS_JOURNAL_DECISION,
+};
+
+enum ccs_journal_source {
+	CCS_JOURNAL_RULE,        /* --rules= file     */
+	CCS_JOURNAL_CACHE,       /* Decision cache    */
+	CCS_JOURNAL_HUMAN,       /* Answered prompt   */
+	CCS_JOURNAL_TIMEOUT,     /* Unanswered prompt */
+	CCS_JOURNAL_LEARN,       /* Learn mode        */
+	CCS_JOURNAL_PASSTHROUGH, /* Profile above 1   */
+	CCS_JOURNAL_FAILURE,     /* No prompt shown   */
+	CCS_JOURNAL_PROVISIONAL, /* Prompt too slow   */
+	CCS_JOURNAL_POLICY,      /* In domain_policy  */
+	CCS_MAX_JOURNAL_SOURCE
+};
+
 /***** CONSTANTS DEFINITION END *****/
 
 /***** STRUCTURES DEFINITION START *****/
@@ -112,13 +148,78 @@ struct ccs_task_entry {
 	int depth;
 };
 
+/*
+ * Journal records, in host byte order after the 8 bytes magic. Every record
+ * starts with this header and is padded to a multiple of 8 bytes.
+ */
+struct ccs_journal_header {
+	u32 length;         /* Including header and padding */
+	u32 type;           /* enum ccs_journal_record_type */
+};
+
+/* Assigns @id to a domainname or ACL line until redefined. */
+struct ccs_journal_name {
+	struct ccs_journal_header head;
+	u32 id;
+	char name[];        /* NUL-terminated */
+};
+
+struct ccs_journal_decision {
+	struct ccs_journal_header head;
+	u32 serial;         /* Query serial number                    */
+	u32 domain;         /* Name id, 0 for non domain queries      */
+	u32 acl;            /* Name id, 0 for non domain queries      */
+	u32 latency_us;     /* From reading the query to the answer   */
+	u64 received_us;    /* Wall clock, microseconds since epoch   */
+	u64 answered_us;
+	u8 verdict;         /* 1 = allow, 2 = deny, 3 = retry         */
+	u8 source;          /* enum ccs_journal_source                */
+	u16 result;         /* ccs-firewall's prompt result, 0 if none */
+	u32 pid;            /* Global pid of the requesting task      */
+};
+
+struct ccs_journal_entry {
+	const struct ccs_journal_decision *record;
+	const char *domainname; /* NULL if unknown */
+	const char *acl;        /* NULL if unknown */
+};
+
+/* Stream split into NUL or newline terminated parts, see ccs_reader_next(). */
+struct ccs_reader {
+	int fd;
+	char *buf;
+	int size;           /* Bytes allocated                  */
+	int start;          /* First byte not handed out yet    */
+	int end;            /* End of the bytes read            */
+};
+
+/* One request queued by ccs_batch_write() or ccs_batch_read(). */
+struct ccs_agent_request {
+	int file;           /* Index in ccs_agent_batch's files      */
+	char *data;         /* Bytes to write, or the reply if read  */
+	int len;
+	_Bool is_read;
+	_Bool done;
+};
+
+/* Requests sent together by ccs_batch_run(). */
+struct ccs_agent_batch {
+	struct ccs_agent_request *list;
+	int len;
+	char **files;       /* One connection each                   */
+	int files_len;
+};
+
 /***** STRUCTURES DEFINITION END *****/
 
 /***** PROTOTYPES DEFINITION START *****/
 
 FILE *ccs_open_read(const char *filename);
 FILE *ccs_open_write(const char *filename);
+_Bool ccs_agent_write(const char *filename, const char *data, const int len);
+_Bool ccs_batch_run(struct ccs_agent_batch *batch);
 _Bool ccs_check_remote_host(void);
+_Bool ccs_close_read(FILE *fp);
 _Bool ccs_close_write(FILE *fp);
 _Bool ccs_correct_domain(const char *domainname);
 _Bool ccs_correct_path(const char *filename);
@@ -130,33 +231,49 @@ _Bool ccs_path_matches_pattern(const struct ccs_path_info *pathname0,
 			       const struct ccs_path_info *pattern0);
 _Bool ccs_pathcmp(const struct ccs_path_info *a,
 		  const struct ccs_path_info *b);
+_Bool ccs_set_profile(const char *domainname, const unsigned int profile);
 _Bool ccs_str_starts(char *str, const char *begin);
 char *ccs_freadline(FILE *fp);
 char *ccs_freadline_unpack(FILE *fp);
+char *ccs_reader_next(struct ccs_reader *reader, const _Bool lines,
+		      int *len, char *delim);
 char *ccs_shprintf(const char *fmt, ...)
 	__attribute__ ((format(printf, 1, 2)));
 char *ccs_strdup(const char *string);
+const char *ccs_batch_reply(const struct ccs_agent_batch *batch,
+			    const int index, int *len);
 const char *ccs_domain_name(const struct ccs_domain_policy *dp,
 			    const int index);
 const struct ccs_path_info *ccs_savename(const char *name);
 int ccs_add_string_entry(struct ccs_domain_policy *dp, const char *entry,
 			 const int index);
 int ccs_assign_domain(struct ccs_domain_policy *dp, const char *domainname);
+int ccs_batch_read(struct ccs_agent_batch *batch, const char *filename);
 int ccs_del_string_entry(struct ccs_domain_policy *dp, const char *entry,
 			 const int index);
 int ccs_find_domain(const struct ccs_domain_policy *dp,
 		    const char *domainname0);
 int ccs_find_domain_by_ptr(struct ccs_domain_policy *dp,
 			   const struct ccs_path_info *domainname);
+int ccs_journal_scan(const char *filename,
+		     _Bool (*func) (const struct ccs_journal_entry *, void *),
+		     void *data);
 int ccs_open_stream(const char *filename);
 int ccs_parse_ip(const char *address, struct ccs_ip_address_entry *entry);
 int ccs_parse_number(const char *number, struct ccs_number_entry *entry);
+int ccs_save_policy(const char *dir);
+int ccs_save_proc_to_file(const char *src, const char *dest);
 int ccs_string_compare(const void *a, const void *b);
 int ccs_write_domain_policy(struct ccs_domain_policy *dp, const int fd);
 struct ccs_path_group_entry *ccs_find_path_group(const char *group_name);
 void *ccs_malloc(const size_t size);
 void *ccs_realloc(void *ptr, const size_t size);
 void *ccs_realloc2(void *ptr, const size_t size);
+void ccs_agent_close_all(void);
+void ccs_batch_free(struct ccs_agent_batch *batch);
+void ccs_batch_init(struct ccs_agent_batch *batch);
+void ccs_batch_write(struct ccs_agent_batch *batch, const char *filename,
+		     const char *data, const int len);
 void ccs_clear_domain_policy(struct ccs_domain_policy *dp);
 void ccs_delete_domain(struct ccs_domain_policy *dp, const int index);
 void ccs_fill_path_info(struct ccs_path_info *ptr);
@@ -169,6 +286,8 @@ void ccs_put(void);
 void ccs_read_domain_policy(struct ccs_domain_policy *dp,
 			    const char *filename);
 void ccs_read_process_list(_Bool show_all);
+void ccs_reader_free(struct ccs_reader *reader);
+void ccs_reader_init(struct ccs_reader *reader, const int fd);
 
 extern _Bool ccs_freadline_raw;
 extern _Bool ccs_network_mode;